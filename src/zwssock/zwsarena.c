@@ -0,0 +1,192 @@
+#include "zwsarena.h"
+#include "zwsatomic.h"
+
+#define ZWSARENA_MIN_SHIFT 6    // Smallest class holds 64 bytes
+#define ZWSARENA_CLASSES 15     // Largest class holds 1 MB, larger buffers come from the heap
+
+typedef struct _zwsarena_block_t zwsarena_block_t;
+
+// Header in front of every buffer
+struct _zwsarena_block_t {
+	zwsarena_block_t* next;     // Next idle or returned block
+	zwsarena_t* arena;          // Owning arena, NULL for a heap buffer
+	size_t size_class;
+	size_t reserved;            // Keeps the buffer aligned like malloc's
+};
+
+struct _zwsarena_t {
+	zwsarena_block_t* idle[ZWSARENA_CLASSES];  // Blocks ready for reuse, by class; owner thread only
+	zwsarena_block_t* returned;                 // Blocks freed since the last drain, pushed from any thread
+	volatile long refs;                         // The owner, plus one per block in use
+	size_t held;                                // Bytes of pooled blocks, idle or in use
+	size_t ceiling;
+};
+
+
+// Private methods
+static size_t zwsarena_class_size(size_t size_class);
+static void zwsarena_drain(zwsarena_t* self);
+static void zwsarena_trim(zwsarena_t* self, size_t needed);
+static void zwsarena_free_all(zwsarena_t* self);
+
+
+zwsarena_t* zwsarena_new(size_t ceiling) {
+	zwsarena_t* self = zmalloc(sizeof(zwsarena_t));
+	self->refs = 1;
+	self->ceiling = ceiling;
+	return self;
+}
+
+void zwsarena_destroy(zwsarena_t** self_p) {
+	zwsarena_t* self = *self_p;
+	if (self) {
+		// Release idle blocks now, blocks in use are freed as they come back
+		zwsarena_drain(self);
+		zwsarena_set_ceiling(self, 0);
+
+		if (ZWS_ATOMIC_DEC(self->refs) == 0) {
+			zwsarena_free_all(self);
+		}
+		*self_p = NULL;
+	}
+}
+
+void zwsarena_set_ceiling(zwsarena_t* self, size_t ceiling) {
+	self->ceiling = ceiling;
+	zwsarena_trim(self, 0);
+}
+
+/**
+ * Allocate a buffer of at least `size` bytes
+ *
+ * Buffers up to the largest class are taken from the idle list of their class, refilled from the
+ * blocks returned by other threads; a new block is only allocated while the ceiling allows it.
+ * Larger buffers, and buffers that would exceed the ceiling, come from the heap.
+*/
+void* zwsarena_alloc(zwsarena_t* self, size_t size) {
+	zwsarena_block_t* block;
+
+	if (self != NULL && size <= zwsarena_class_size(ZWSARENA_CLASSES - 1)) {
+		size_t size_class = 0;
+		while (zwsarena_class_size(size_class) < size) {
+			size_class++;
+		}
+		size_t class_size = zwsarena_class_size(size_class);
+
+		if (self->idle[size_class] == NULL) {
+			zwsarena_drain(self);
+		}
+
+		block = self->idle[size_class];
+		if (block != NULL) {
+			self->idle[size_class] = block->next;
+
+		} else {
+			// Make room by giving idle blocks of other classes back to the heap
+			if (self->held + class_size > self->ceiling) {
+				zwsarena_trim(self, class_size);
+			}
+
+			if (self->held + class_size <= self->ceiling) {
+				block = (zwsarena_block_t*)malloc(sizeof(zwsarena_block_t) + class_size);
+				if (block == NULL) {
+					return NULL;
+				}
+				block->arena = self;
+				block->size_class = size_class;
+				self->held += class_size;
+			}
+		}
+
+		if (block != NULL) {
+			block->next = NULL;
+			ZWS_ATOMIC_INC(self->refs);
+			return block + 1;
+		}
+	}
+
+	if (size > SIZE_MAX - sizeof(zwsarena_block_t)) {
+		return NULL;
+	}
+
+	block = (zwsarena_block_t*)malloc(sizeof(zwsarena_block_t) + size);
+	if (block == NULL) {
+		return NULL;
+	}
+	block->next = NULL;
+	block->arena = NULL;
+	return block + 1;
+}
+
+void zwsarena_free(void* data) {
+	if (data == NULL) {
+		return;
+	}
+
+	zwsarena_block_t* block = (zwsarena_block_t*)data - 1;
+	zwsarena_t* self = block->arena;
+
+	if (self == NULL) {
+		free(block);
+		return;
+	}
+
+	// Lock-free push, the owner takes the whole list at once when it drains
+	zwsarena_block_t* head;
+	do {
+		head = ZWS_ATOMIC_LOAD_PTR(self->returned);
+		block->next = head;
+	} while (!ZWS_ATOMIC_CAS_PTR(self->returned, head, block));
+
+	// Last block of a destroyed arena
+	if (ZWS_ATOMIC_DEC(self->refs) == 0) {
+		zwsarena_free_all(self);
+	}
+}
+
+static size_t zwsarena_class_size(size_t size_class) {
+	return (size_t)1 << (ZWSARENA_MIN_SHIFT + size_class);
+}
+
+/**
+ * Move returned blocks to the idle lists, or back to the heap while above the ceiling
+*/
+static void zwsarena_drain(zwsarena_t* self) {
+	zwsarena_block_t* block = (zwsarena_block_t*)ZWS_ATOMIC_EXCHANGE_PTR(self->returned, NULL);
+
+	while (block != NULL) {
+		zwsarena_block_t* next = block->next;
+
+		if (self->held > self->ceiling) {
+			self->held -= zwsarena_class_size(block->size_class);
+			free(block);
+		} else {
+			block->next = self->idle[block->size_class];
+			self->idle[block->size_class] = block;
+		}
+		block = next;
+	}
+}
+
+/**
+ * Give idle blocks back to the heap, largest first, until `needed` more bytes fit under the ceiling
+*/
+static void zwsarena_trim(zwsarena_t* self, size_t needed) {
+	for (int size_class = ZWSARENA_CLASSES - 1; size_class >= 0; size_class--) {
+		while (self->idle[size_class] != NULL && self->held + needed > self->ceiling) {
+			zwsarena_block_t* block = self->idle[size_class];
+			self->idle[size_class] = block->next;
+			self->held -= zwsarena_class_size(size_class);
+			free(block);
+		}
+	}
+}
+
+/**
+ * Free a destroyed arena and its blocks, its ceiling is 0 so nothing is kept
+*/
+static void zwsarena_free_all(zwsarena_t* self) {
+	zwsarena_drain(self);
+	zwsarena_trim(self, 0);
+	free(self);
+}
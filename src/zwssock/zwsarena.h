@@ -0,0 +1,31 @@
+#ifndef ZWSARENA_H_
+#define ZWSARENA_H_
+
+#include <czmq.h>
+
+// Size-classed pool of recycled buffers, owned by one thread and shared by its decoders
+typedef struct _zwsarena_t zwsarena_t;
+
+// Pooled buffers held (in use or idle) are capped at `ceiling` bytes; 0 disables pooling
+zwsarena_t* zwsarena_new(size_t ceiling);
+
+// Buffers still in use stay valid, the arena is freed with the last of them
+void zwsarena_destroy(zwsarena_t** self_p);
+
+void zwsarena_set_ceiling(zwsarena_t* self, size_t ceiling);
+
+// Owner thread only; `self` may be NULL to allocate from the heap. Returns NULL on failure
+void* zwsarena_alloc(zwsarena_t* self, size_t size);
+
+// Return a buffer to its arena; may be called from any thread
+void zwsarena_free(void* data);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // ZWSARENA_H_
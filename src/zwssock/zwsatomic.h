@@ -0,0 +1,23 @@
+#ifndef ZWSATOMIC_H_
+#define ZWSATOMIC_H_
+
+// Atomic operations on reference counts and lock-free lists shared with the application thread
+
+#if defined(_MSC_VER)
+	#include <intrin.h>
+	#define ZWS_ATOMIC_INC(x) _InterlockedIncrement(&(x))
+	#define ZWS_ATOMIC_DEC(x) _InterlockedDecrement(&(x))
+	#define ZWS_ATOMIC_LOAD_PTR(x) (x)
+	#define ZWS_ATOMIC_EXCHANGE_PTR(x, value) _InterlockedExchangePointer((void* volatile*)&(x), (value))
+	#define ZWS_ATOMIC_CAS_PTR(x, expected, value) \
+		(_InterlockedCompareExchangePointer((void* volatile*)&(x), (value), (expected)) == (expected))
+#else
+	#define ZWS_ATOMIC_INC(x) __atomic_add_fetch(&(x), 1, __ATOMIC_RELAXED)
+	#define ZWS_ATOMIC_DEC(x) __atomic_sub_fetch(&(x), 1, __ATOMIC_ACQ_REL)
+	#define ZWS_ATOMIC_LOAD_PTR(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+	#define ZWS_ATOMIC_EXCHANGE_PTR(x, value) __atomic_exchange_n(&(x), (value), __ATOMIC_ACQUIRE)
+	#define ZWS_ATOMIC_CAS_PTR(x, expected, value) \
+		__atomic_compare_exchange_n(&(x), &(expected), (value), false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)
+#endif
+
+#endif  // ZWSATOMIC_H_
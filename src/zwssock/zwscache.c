@@ -0,0 +1,193 @@
+#include "zwscache.h"
+#include "zwstable.h"
+
+#define ZWSCACHE_CANDIDATES 64      // Payloads seen once, remembered by key until seen again
+
+typedef struct _zwscache_entry_t zwscache_entry_t;
+
+struct _zwscache_entry_t {
+	zwscache_key_t key;         // Also the entry's key in the table
+	byte* payload;              // Copy of the payload, told apart from others with the same hash
+	zmq_msg_t frame;
+	size_t bytes;
+	zwscache_entry_t* prev;     // More recently used
+	zwscache_entry_t* next;     // Less recently used
+};
+
+struct _zwscache_t {
+	zwstable_t* entries;
+	zwscache_entry_t* newest;
+	zwscache_entry_t* oldest;
+	zwscache_key_t candidates[ZWSCACHE_CANDIDATES];
+	size_t next_candidate;
+	size_t size;
+	size_t ceiling;
+};
+
+
+// Private methods
+static uint64_t zwscache_hash(const byte* data, size_t size);
+static void zwscache_unlink(zwscache_t* self, zwscache_entry_t* entry);
+static void zwscache_push(zwscache_t* self, zwscache_entry_t* entry);
+static void zwscache_evict(zwscache_t* self, zwscache_entry_t* entry);
+static void zwscache_trim(zwscache_t* self, size_t needed);
+
+
+zwscache_t* zwscache_new(size_t ceiling) {
+	zwscache_t* self = zmalloc(sizeof(zwscache_t));
+	self->entries = zwstable_new();
+	self->ceiling = ceiling;
+	return self;
+}
+
+void zwscache_destroy(zwscache_t** self_p) {
+	zwscache_t* self = *self_p;
+	if (self) {
+		while (self->oldest != NULL) {
+			zwscache_evict(self, self->oldest);
+		}
+		zwstable_destroy(&self->entries);
+		free(self);
+		*self_p = NULL;
+	}
+}
+
+void zwscache_set_ceiling(zwscache_t* self, size_t ceiling) {
+	self->ceiling = ceiling;
+	zwscache_trim(self, 0);
+}
+
+bool zwscache_enabled(zwscache_t* self) {
+	return self->ceiling > 0;
+}
+
+void zwscache_key(zwscache_key_t* key, byte flag, const byte* data, size_t size, int window_bits, int mem_level) {
+	// Cleared first, keys are compared byte for byte, padding included
+	memset(key, 0, sizeof(zwscache_key_t));
+	key->hash = zwscache_hash(data, size);
+	key->size = size;
+	key->flag = flag;
+	key->window_bits = (byte)window_bits;
+	key->mem_level = (byte)mem_level;
+}
+
+zmq_msg_t* zwscache_lookup(zwscache_t* self, const zwscache_key_t* key, const byte* data, bool* admit) {
+	*admit = false;
+	if (self->ceiling == 0) {
+		return NULL;
+	}
+
+	zwscache_entry_t* entry = (zwscache_entry_t *)zwstable_lookup(self->entries, (const byte *)key, sizeof(zwscache_key_t));
+	if (entry != NULL && memcmp(entry->payload, data, key->size) == 0) {
+		zwscache_unlink(self, entry);
+		zwscache_push(self, entry);
+		return &entry->frame;
+	}
+
+	// Only payloads seen twice are worth the copy; a payload that can't fit half the cache never is
+	if (key->size > self->ceiling / 2) {
+		return NULL;
+	}
+	for (size_t i = 0; i < ZWSCACHE_CANDIDATES; i++) {
+		if (memcmp(&self->candidates[i], key, sizeof(zwscache_key_t)) == 0) {
+			*admit = true;
+			return NULL;
+		}
+	}
+	self->candidates[self->next_candidate] = *key;
+	self->next_candidate = (self->next_candidate + 1) % ZWSCACHE_CANDIDATES;
+	return NULL;
+}
+
+zmq_msg_t* zwscache_insert(zwscache_t* self, const zwscache_key_t* key, const byte* data, zmq_msg_t* frame) {
+	// An entry with the same key holds another payload with the same hash, it gives way
+	zwscache_entry_t* entry = (zwscache_entry_t *)zwstable_lookup(self->entries, (const byte *)key, sizeof(zwscache_key_t));
+	if (entry != NULL) {
+		zwscache_evict(self, entry);
+	}
+
+	entry = (zwscache_entry_t *)zmalloc(sizeof(zwscache_entry_t));
+	entry->key = *key;
+	entry->payload = (byte *)malloc(key->size > 0 ? key->size : 1);
+	assert(entry->payload);
+	memcpy(entry->payload, data, key->size);
+	zmq_msg_init(&entry->frame);
+	zmq_msg_move(&entry->frame, frame);
+	entry->bytes = key->size + zmq_msg_size(&entry->frame);
+
+	zwscache_trim(self, entry->bytes);
+	zwstable_insert(self->entries, (const byte *)&entry->key, sizeof(zwscache_key_t), entry);
+	zwscache_push(self, entry);
+	self->size += entry->bytes;
+	return &entry->frame;
+}
+
+size_t zwscache_size(zwscache_t* self) {
+	return self->size;
+}
+
+/**
+ * Multiply and fold a word at a time; collisions cost a memcmp, not a wrong message
+*/
+static uint64_t zwscache_hash(const byte* data, size_t size) {
+	uint64_t hash = 0x9e3779b97f4a7c15ULL ^ size;
+	uint64_t word;
+	size_t i = 0;
+
+	for (; i + sizeof(word) <= size; i += sizeof(word)) {
+		memcpy(&word, data + i, sizeof(word));
+		hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+		hash ^= hash >> 32;
+	}
+
+	word = 0;
+	memcpy(&word, data + i, size - i);
+	hash = (hash ^ word) * 0xc4ceb9fe1a85ec53ULL;
+	return hash ^ (hash >> 29);
+}
+
+static void zwscache_unlink(zwscache_t* self, zwscache_entry_t* entry) {
+	if (entry->prev != NULL) {
+		entry->prev->next = entry->next;
+	} else {
+		self->newest = entry->next;
+	}
+	if (entry->next != NULL) {
+		entry->next->prev = entry->prev;
+	} else {
+		self->oldest = entry->prev;
+	}
+	entry->prev = NULL;
+	entry->next = NULL;
+}
+
+static void zwscache_push(zwscache_t* self, zwscache_entry_t* entry) {
+	entry->next = self->newest;
+	if (self->newest != NULL) {
+		self->newest->prev = entry;
+	} else {
+		self->oldest = entry;
+	}
+	self->newest = entry;
+}
+
+/**
+ * Drop an entry; clients still sending its frame hold their own copies
+*/
+static void zwscache_evict(zwscache_t* self, zwscache_entry_t* entry) {
+	zwscache_unlink(self, entry);
+	zwstable_delete(self->entries, (const byte *)&entry->key, sizeof(zwscache_key_t));
+	self->size -= entry->bytes;
+	zmq_msg_close(&entry->frame);
+	free(entry->payload);
+	free(entry);
+}
+
+/**
+ * Evict the least recently used entries until `needed` more bytes fit under the ceiling
+*/
+static void zwscache_trim(zwscache_t* self, size_t needed) {
+	while (self->oldest != NULL && self->size + needed > self->ceiling) {
+		zwscache_evict(self, self->oldest);
+	}
+}
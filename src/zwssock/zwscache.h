@@ -0,0 +1,49 @@
+#ifndef ZWSCACHE_H_
+#define ZWSCACHE_H_
+
+#include <czmq.h>
+
+// Compressed messages by content, owned by one thread. Each entry maps a payload, its JSMQ flag and
+// the deflate parameters to the WebSocket frame carrying it compressed, least recently used first out
+typedef struct _zwscache_t zwscache_t;
+
+// What a compressed frame depends on, besides the payload itself
+typedef struct {
+	uint64_t hash;
+	uint64_t size;
+	byte flag;
+	byte window_bits;
+	byte mem_level;
+} zwscache_key_t;
+
+// Entries, payload copies included, are capped at `ceiling` bytes; 0 disables the cache
+zwscache_t* zwscache_new(size_t ceiling);
+
+// Frames still being sent stay valid, they are freed with their last copy
+void zwscache_destroy(zwscache_t** self_p);
+
+void zwscache_set_ceiling(zwscache_t* self, size_t ceiling);
+
+bool zwscache_enabled(zwscache_t* self);
+
+void zwscache_key(zwscache_key_t* key, byte flag, const byte* data, size_t size, int window_bits, int mem_level);
+
+// Cached frame for the payload, valid until the next insert; NULL on a miss. On a miss, `admit` is set
+// if the payload was looked up recently: the caller should compress it and insert the frame
+zmq_msg_t* zwscache_lookup(zwscache_t* self, const zwscache_key_t* key, const byte* data, bool* admit);
+
+// Cache a frame, taking it over, and return it; entries are evicted to make room, but the new one is kept
+zmq_msg_t* zwscache_insert(zwscache_t* self, const zwscache_key_t* key, const byte* data, zmq_msg_t* frame);
+
+// Bytes held by the entries
+size_t zwscache_size(zwscache_t* self);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // ZWSCACHE_H_
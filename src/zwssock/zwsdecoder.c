@@ -1,5 +1,19 @@
+#include <limits.h>
+
 #include "zwsdecoder.h"
+#include "zwsatomic.h"
+
+#if defined(__AVX2__)
+	#include <immintrin.h>
+	#define ZWS_UNMASK_WIDTH 32
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define ZWS_UNMASK_WIDTH 16
+#else
+	#define ZWS_UNMASK_WIDTH 8
+#endif
 
+#define INFLATE_MIN_BUFFER 64
 
 typedef enum {
 	opcode_continuation		= 0,
@@ -35,16 +49,34 @@ typedef enum {
 	STATE_ERROR
 } state_t;
 
+struct _zwsdecoder_buffer_t {
+	volatile long refs;
+	zframe_t* frame;        // Received stream frame the payload lies in, NULL if the payload follows this struct
+};
+
 struct _zwsdecoder_t {
 	state_t state;
 	opcode_t opcode;
+	bool final;
+	bool compressed;                      // RSV1 was set on the first frame of the current data message
+	bool permessage_deflate;              // RSV1 is allowed, the client negotiated permessage-deflate
 	bool is_masked;
 	byte mask[4];
+	zwsdecoder_buffer_t* payload_buffer;  // Owns `payload` while a frame spanning several reads is assembled
 	byte* payload;
-	int payload_length;
-	int payload_index;
+	uint64_t payload_length;
+	uint64_t payload_index;
+
+	bool fragmented;                      // A fragmented data message is in progress
+	zwsdecoder_buffer_t* message_buffer;  // Reassembly buffer of the fragmented message, data follows the struct
+	size_t message_length;                // Bytes received so far for the current data message
+	size_t message_capacity;
+	size_t max_message_size;
+	zwsarena_t* arena;                    // Pool the payload buffers come from, NULL for the heap
+
 	void* tag;
 	message_callback_t message_cb;
+	fragment_callback_t fragment_cb;
 	close_callback_t close_cb;
 	ping_callback_t ping_cb;
 	pong_callback_t pong_cb;
@@ -52,9 +84,16 @@ struct _zwsdecoder_t {
 
 
 // Private methods
-static void invoke_new_message(zwsdecoder_t* self);
+static void invoke_new_message(zwsdecoder_t* self, byte* payload, zwsdecoder_buffer_t* buffer);
+static zwsdecoder_buffer_t* zwsdecoder_buffer_new(zwsdecoder_t* self, zframe_t* frame, size_t size);
 static state_t zwsdecoder_next_state(zwsdecoder_t* self);
 static void zwsdecoder_process_byte(zwsdecoder_t* self, byte b);
+static size_t zwsdecoder_process_header(zwsdecoder_t* self, byte* buffer, size_t available);
+static state_t zwsdecoder_first_byte(zwsdecoder_t* self, byte b);
+static state_t zwsdecoder_payload_state(zwsdecoder_t* self);
+static bool zwsdecoder_is_reassembling(zwsdecoder_t* self);
+static bool zwsdecoder_reserve_message(zwsdecoder_t* self, size_t length);
+static void zwsdecoder_unmask(byte* data, size_t length, const byte mask[4], size_t offset);
 
 
 zwsdecoder_t* zwsdecoder_new(
@@ -71,49 +110,103 @@ zwsdecoder_t* zwsdecoder_new(
 	self->close_cb = close_cb;
 	self->ping_cb = ping_cb;
 	self->pong_cb = pong_cb;
+	self->payload_buffer = NULL;
 	self->payload = NULL;
+	self->fragmented = false;
+	self->message_buffer = NULL;
+	self->message_length = 0;
+	self->message_capacity = 0;
+	self->max_message_size = 0;
+	self->fragment_cb = NULL;
+	self->arena = NULL;
+	self->compressed = false;
+	self->permessage_deflate = false;
 
 	return self;
 }
 
 void zwsdecoder_destroy(zwsdecoder_t** self_p) {
 	zwsdecoder_t* self = *self_p;
+	if (self->payload_buffer != NULL) {
+		zwsdecoder_buffer_release(NULL, self->payload_buffer);
+	}
+	if (self->message_buffer != NULL) {
+		zwsdecoder_buffer_release(NULL, self->message_buffer);
+	}
 	free(self);
 	*self_p = NULL;
 }
 
-void zwsdecoder_process_buffer(zwsdecoder_t* self, zframe_t* data) {
-	int i = 0;
+/**
+ * Decode a frame read from the stream, taking ownership of it
+ *
+ * Payloads that lie entirely within the frame are unmasked in place and handed to the callbacks
+ * without a copy, backed by a buffer sharing the frame; only payloads spanning reads are copied.
+*/
+void zwsdecoder_process_buffer(zwsdecoder_t* self, zframe_t** data_p) {
+	size_t i = 0;
+
+	zframe_t* data = *data_p;
+	*data_p = NULL;
 
 	byte* buffer = zframe_data(data);
-	int buffer_length = zframe_size(data);
-	int bytes_to_read;
+	size_t buffer_length = zframe_size(data);
+	size_t bytes_to_read;
+	size_t header_length;
+	zwsdecoder_buffer_t* stream_buffer = NULL; // Shares `data` with in-place payloads, created on first use
 
-	while (i < buffer_length) {
+	while (i < buffer_length && self->state != STATE_ERROR) {
 		switch (self->state) {
-			case STATE_ERROR:
-				return;
-
 			// Set-up payload
 			case STATE_BEGIN_PAYLOAD:
 				self->payload_index = 0;
-				self->payload = zmalloc(sizeof(byte) * (self->payload_length + 4)); // +4 extra bytes in case we have to inflate it
+
+				// Fragment of a message being reassembled, decode it straight into the message buffer
+				if (zwsdecoder_is_reassembling(self)) {
+					if (!zwsdecoder_reserve_message(self, self->payload_length)) {
+						self->state = STATE_ERROR;
+						break;
+					}
+					self->payload = (byte*)(self->message_buffer + 1) + self->message_length;
+
+				// Payload is entirely within this read, unmask it in place
+				} else if (self->payload_length <= buffer_length - i) {
+					if (self->is_masked) {
+						zwsdecoder_unmask(buffer + i, self->payload_length, self->mask, 0);
+					}
+
+					if (stream_buffer == NULL) {
+						stream_buffer = zwsdecoder_buffer_new(self, data, 0);
+					}
+
+					self->state = STATE_NEW_MESSAGE;
+					invoke_new_message(self, buffer + i, stream_buffer);
+					i += self->payload_length;
+					break;
+
+				// Payload spans reads, assemble a copy
+				} else {
+					self->payload_buffer = zwsdecoder_buffer_new(self, NULL, self->payload_length);
+					if (self->payload_buffer == NULL) {
+						self->state = STATE_ERROR;
+						break;
+					}
+					self->payload = (byte*)(self->payload_buffer + 1);
+				}
 
 
 			case STATE_PAYLOAD:
-				bytes_to_read = self->payload_length - self->payload_index;
+				bytes_to_read = buffer_length - i;
 
-				if (bytes_to_read > (buffer_length - i)) {
-					bytes_to_read = buffer_length - i;
+				if (bytes_to_read > self->payload_length - self->payload_index) {
+					bytes_to_read = self->payload_length - self->payload_index;
 				}
 
 				memcpy(self->payload + self->payload_index, buffer + i, bytes_to_read);
 
 				// If masked, apply the mask
 				if (self->is_masked) {
-					for (int j = self->payload_index; j < self->payload_index + bytes_to_read; j++) {
-						self->payload[j] = self->payload[j] ^ self->mask[(j) % 4];
-					}
+					zwsdecoder_unmask(self->payload + self->payload_index, bytes_to_read, self->mask, self->payload_index);
 				}
 
 				self->payload_index += bytes_to_read;
@@ -126,40 +219,200 @@ void zwsdecoder_process_buffer(zwsdecoder_t* self, zframe_t* data) {
 				// If we have passed the payload, we are processing a new message
 				} else {
 					self->state = STATE_NEW_MESSAGE;
-					invoke_new_message(self);
+					invoke_new_message(self, self->payload, self->payload_buffer);
+
+					if (self->payload_buffer != NULL) {
+						zwsdecoder_buffer_release(NULL, self->payload_buffer);
+						self->payload_buffer = NULL;
+					}
+					self->payload = NULL;
 				}
 				break;
 
+			// Fast path: decode the whole header in one step when it is in this buffer
+			case STATE_NEW_MESSAGE:
+				header_length = zwsdecoder_process_header(self, buffer + i, buffer_length - i);
+				if (header_length > 0) {
+					i += header_length;
+					break;
+				}
+
+				// Header is split across reads, fall back to the byte state machine
+				zwsdecoder_process_byte(self, buffer[i]);
+				i++;
+				break;
+
 			default:
 				zwsdecoder_process_byte(self, buffer[i]);
 				i++;
 				break;
 		}
 	}
+
+	if (stream_buffer != NULL) {
+		zwsdecoder_buffer_release(NULL, stream_buffer);
+	} else {
+		zframe_destroy(&data);
+	}
 }
 
-static void zwsdecoder_process_byte(zwsdecoder_t* self, byte b) {
-	bool final;
+/**
+ * Decode a complete frame header (2 - 14 bytes) in one step
+ *
+ * Returns the number of bytes consumed, or 0 if the header is not entirely within `available`
+ * bytes, in which case nothing is consumed and the caller uses the byte state machine instead.
+*/
+static size_t zwsdecoder_process_header(zwsdecoder_t* self, byte* buffer, size_t available) {
+	if (available < 2) {
+		return 0;
+	}
 
-	switch (self->state) {
-		case STATE_NEW_MESSAGE:
-			final = (b & 0x80) != 0; // final bit
-			self->opcode = b & 0xF; // opcode bit
+	byte length = (byte)(buffer[1] & 0x7F);
+	bool is_masked = (buffer[1] & 0x80) != 0;
+	size_t header_length = 2 + (length == 126 ? 2 : 0) + (length == 127 ? 8 : 0) + (is_masked ? 4 : 0);
 
+	if (available < header_length) {
+		return 0;
+	}
 
-			// not final messages are currently not supported
-			if (!final) {
-				self->state = STATE_ERROR;
+	self->state = zwsdecoder_first_byte(self, buffer[0]);
+	if (self->state == STATE_ERROR) {
+		return header_length;
+	}
 
-			// Check that the opcode is supported
-			} else if (self->opcode != opcode_binary
-						&& self->opcode != opcode_close
-						&& self->opcode != opcode_ping
-						&& self->opcode != opcode_pong) {
-				self->state = STATE_ERROR;
-			} else {
-				self->state = STATE_SECOND_BYTE;
-			}
+	self->is_masked = is_masked;
+	int index = 2;
+
+	if (length < 126) {
+		self->payload_length = length;
+
+	} else if (length == 126) {
+		self->payload_length = buffer[2] << 8 | buffer[3];
+		index += 2;
+
+	} else {
+		self->payload_length = 0;
+		for (; index < 10; index++) {
+			self->payload_length = self->payload_length << 8 | buffer[index];
+		}
+	}
+
+	if (is_masked) {
+		memcpy(self->mask, buffer + index, 4);
+	}
+
+	self->state = zwsdecoder_payload_state(self);
+	return header_length;
+}
+
+/**
+ * Validate the first header byte (FIN bit, RSV1 and opcode), returning the next state
+*/
+static state_t zwsdecoder_first_byte(zwsdecoder_t* self, byte b) {
+	self->final = (b & 0x80) != 0; // final bit
+	self->opcode = b & 0xF; // opcode bit
+	bool rsv1 = (b & 0x40) != 0; // compressed message bit (RFC 7692), on the first frame only
+
+	switch (self->opcode) {
+		// A fragmented message starts with a binary frame and continues with continuation frames
+		case opcode_binary:
+			self->compressed = rsv1;
+			return self->fragmented || (rsv1 && !self->permessage_deflate) ? STATE_ERROR : STATE_SECOND_BYTE;
+
+		case opcode_continuation:
+			return self->fragmented && !rsv1 ? STATE_SECOND_BYTE : STATE_ERROR;
+
+		// Control frames may be interleaved with fragments, but are never fragmented (nor compressed) themselves
+		case opcode_close:
+		case opcode_ping:
+		case opcode_pong:
+			return self->final && !rsv1 ? STATE_SECOND_BYTE : STATE_ERROR;
+
+		default:
+			return STATE_ERROR;
+	}
+}
+
+/**
+ * Validate the decoded payload length, returning the state that follows the header
+*/
+static state_t zwsdecoder_payload_state(zwsdecoder_t* self) {
+	// The most significant bit of a 64 bit length must be 0, and the payload must be addressable
+	if (self->payload_length > INT64_MAX || self->payload_length > SIZE_MAX) {
+		return STATE_ERROR;
+	}
+
+	if (self->opcode >= opcode_close) {
+		// Control frames carry at most 125 bytes
+		if (self->payload_length > 125) {
+			return STATE_ERROR;
+		}
+	} else if (self->max_message_size > 0 && self->message_length + self->payload_length > self->max_message_size) {
+		return STATE_ERROR;
+	}
+
+	if (self->payload_length == 0) {
+		invoke_new_message(self, NULL, NULL);
+		return STATE_NEW_MESSAGE;
+	}
+
+	return STATE_BEGIN_PAYLOAD;
+}
+
+/**
+ * Whether the current frame is a fragment to be copied into the reassembly buffer
+*/
+static bool zwsdecoder_is_reassembling(zwsdecoder_t* self) {
+	if (self->fragment_cb != NULL) {
+		return false;
+	}
+
+	return self->opcode == opcode_continuation || (self->opcode == opcode_binary && !self->final);
+}
+
+/**
+ * Make room for `length` more bytes in the reassembly buffer, growing it geometrically
+ *
+ * Returns false if the buffer could not be grown.
+*/
+static bool zwsdecoder_reserve_message(zwsdecoder_t* self, size_t length) {
+	if (length > SIZE_MAX - self->message_length) {
+		return false;
+	}
+
+	size_t required = self->message_length + length;
+	if (required <= self->message_capacity) {
+		return true;
+	}
+
+	size_t capacity = self->message_capacity > 0 ? self->message_capacity : 4096;
+	while (capacity < required) {
+		capacity = capacity > SIZE_MAX / 2 ? required : capacity * 2;
+	}
+
+	// Don't overshoot the limit, the message can't grow past it
+	if (self->max_message_size > 0 && capacity > self->max_message_size) {
+		capacity = self->max_message_size;
+	}
+
+	zwsdecoder_buffer_t* message = zwsdecoder_buffer_new(self, NULL, capacity);
+	if (message == NULL) {
+		return false;
+	}
+
+	if (self->message_buffer != NULL) {
+		memcpy(message + 1, self->message_buffer + 1, self->message_length);
+		zwsdecoder_buffer_release(NULL, self->message_buffer);
+	}
+	self->message_buffer = message;
+	self->message_capacity = capacity;
+	return true;
+}
+
+static void zwsdecoder_process_byte(zwsdecoder_t* self, byte b) {
+	switch (self->state) {
+		case STATE_NEW_MESSAGE:
+			self->state = zwsdecoder_first_byte(self, b);
 			break;
 
 		case STATE_SECOND_BYTE:
@@ -199,7 +452,7 @@ static void zwsdecoder_process_byte(zwsdecoder_t* self, byte b) {
 			break;
 
 		case STATE_SHORT_SIZE:
-			self->payload_length = b << 8;
+			self->payload_length = (uint64_t)b << 8;
 			self->state = STATE_SHORT_SIZE_2;
 			break;
 
@@ -210,60 +463,20 @@ static void zwsdecoder_process_byte(zwsdecoder_t* self, byte b) {
 
 		case STATE_LONG_SIZE:
 			self->payload_length = 0;
-
-			// must be zero, max message size is MaxInt
-			if (b != 0) {
-				self->state = STATE_ERROR;
-			}
-			else
-				self->state = STATE_LONG_SIZE_2;
-
-			break;
+			// fallthrough
 
 		case STATE_LONG_SIZE_2:
-			// must be zero, max message size is MaxInt
-			if (b != 0) {
-				self->state = STATE_ERROR;
-			}
-			else
-				self->state = STATE_LONG_SIZE_3;
-			break;
-
 		case STATE_LONG_SIZE_3:
-			// must be zero, max message size is MaxInt
-			if (b != 0) {
-				self->state = STATE_ERROR;
-			}
-			else
-				self->state = STATE_LONG_SIZE_4;
-			break;
-
 		case STATE_LONG_SIZE_4:
-			// must be zero, max message size is MaxInt
-			if (b != 0) {
-				self->state = STATE_ERROR;
-			}
-			else
-				self->state = STATE_LONG_SIZE_5;
-			break;
-
 		case STATE_LONG_SIZE_5:
-			self->payload_length |= b << 24;
-			self->state = STATE_LONG_SIZE_6;
-			break;
-
 		case STATE_LONG_SIZE_6:
-			self->payload_length |= b << 16;
-			self->state = STATE_LONG_SIZE_7;
-			break;
-
 		case STATE_LONG_SIZE_7:
-			self->payload_length |= b << 8;
-			self->state = STATE_LONG_SIZE_8;
+			self->payload_length = self->payload_length << 8 | b;
+			self->state = (state_t)(self->state + 1);
 			break;
 
 		case STATE_LONG_SIZE_8:
-			self->payload_length |= b;
+			self->payload_length = self->payload_length << 8 | b;
 			self->state = zwsdecoder_next_state(self);
 			break;
 
@@ -279,46 +492,243 @@ static void zwsdecoder_process_byte(zwsdecoder_t* self, byte b) {
 	}
 }
 
+/**
+ * Unmask a slice of payload in place
+ *
+ * `offset` is the position of `data` within the frame payload, which keeps the mask phase correct
+ * when a frame is split across several reads. The bulk of the slice is XORed a machine word or
+ * vector register at a time; only the unaligned head and the tail are handled byte by byte.
+*/
+static void zwsdecoder_unmask(byte* data, size_t length, const byte mask[4], size_t offset) {
+	size_t i = 0;
+
+	// Unaligned head, one byte at a time
+	while (i < length && ((uintptr_t)(data + i) % ZWS_UNMASK_WIDTH) != 0) {
+		data[i] ^= mask[(offset + i) % 4];
+		i++;
+	}
+
+	if (length - i >= 8) {
+		// Mask rotated to the current phase; every wide step below is a multiple of 4 bytes long,
+		// so the phase does not change until the tail
+		byte phased[8];
+		for (int j = 0; j < 8; j++) {
+			phased[j] = mask[(offset + i + j) % 4];
+		}
+
+		uint64_t mask64;
+		memcpy(&mask64, phased, sizeof(mask64));
+
+#if ZWS_UNMASK_WIDTH >= 16
+		uint32_t mask32;
+		memcpy(&mask32, phased, sizeof(mask32));
+#endif
+#if ZWS_UNMASK_WIDTH == 32
+		__m256i mask256 = _mm256_set1_epi32((int)mask32);
+		for (; length - i >= 32; i += 32) {
+			__m256i block = _mm256_load_si256((__m256i*)(data + i));
+			_mm256_store_si256((__m256i*)(data + i), _mm256_xor_si256(block, mask256));
+		}
+#endif
+#if ZWS_UNMASK_WIDTH >= 16
+		__m128i mask128 = _mm_set1_epi32((int)mask32);
+		for (; length - i >= 16; i += 16) {
+			__m128i block = _mm_load_si128((__m128i*)(data + i));
+			_mm_store_si128((__m128i*)(data + i), _mm_xor_si128(block, mask128));
+		}
+#endif
+		for (; length - i >= 8; i += 8) {
+			uint64_t block;
+			memcpy(&block, data + i, sizeof(block));
+			block ^= mask64;
+			memcpy(data + i, &block, sizeof(block));
+		}
+	}
+
+	// Tail
+	for (; i < length; i++) {
+		data[i] ^= mask[(offset + i) % 4];
+	}
+}
+
 static state_t zwsdecoder_next_state(zwsdecoder_t* self) {
 	if ((self->state == STATE_LONG_SIZE_8 || self->state == STATE_SECOND_BYTE || self->state == STATE_SHORT_SIZE_2) && self->is_masked) {
 		return STATE_MASK;
 	}
 	else {
-		if (self->payload_length == 0) {
-			invoke_new_message(self);
-
-			return STATE_NEW_MESSAGE;
-		}
-		else
-			return STATE_BEGIN_PAYLOAD;
-
+		return zwsdecoder_payload_state(self);
 	}
 }
 
-static void invoke_new_message(zwsdecoder_t* self) {
+static void invoke_new_message(zwsdecoder_t* self, byte* payload, zwsdecoder_buffer_t* buffer) {
+	bool first = self->opcode != opcode_continuation;
+	zwsdecoder_buffer_t* message;
+	size_t message_length;
+
 	switch (self->opcode) {
 		case opcode_binary:
-			self->message_cb(self->tag, self->payload, self->payload_length);
+		case opcode_continuation:
+			self->fragmented = !self->final;
+
+			if (self->fragment_cb != NULL) {
+				self->message_length = self->final ? 0 : self->message_length + self->payload_length;
+				self->fragment_cb(self->tag, payload, self->payload_length, buffer, first, self->final);
+
+			} else if (first && self->final) {
+				self->message_cb(self->tag, payload, self->payload_length, buffer);
+
+			// The fragment was decoded into the reassembly buffer
+			} else {
+				self->message_length += self->payload_length;
+				if (!self->final) {
+					break;
+				}
+
+				message = self->message_buffer;
+				message_length = self->message_length;
+				self->message_buffer = NULL;
+				self->message_length = 0;
+				self->message_capacity = 0;
+
+				if (message != NULL) {
+					self->message_cb(self->tag, (byte*)(message + 1), message_length, message);
+					zwsdecoder_buffer_release(NULL, message);
+				} else {
+					self->message_cb(self->tag, NULL, 0, NULL);
+				}
+			}
 			break;
 		case opcode_close:
-			self->close_cb(self->tag, self->payload, self->payload_length);
+			self->close_cb(self->tag, payload, self->payload_length);
 			break;
 		case opcode_ping:
-			self->ping_cb(self->tag, self->payload, self->payload_length);
+			self->ping_cb(self->tag, payload, self->payload_length);
 			break;
 		case opcode_pong:
-			self->pong_cb(self->tag, self->payload, self->payload_length);
+			self->pong_cb(self->tag, payload, self->payload_length);
 			break;
 		default:
 			assert(false);
 	}
+}
+
+/**
+ * Create a payload buffer with one reference
+ *
+ * Either shares (and takes ownership of) a received frame, or holds `size` bytes of payload
+ * directly after the struct, so an assembled payload costs a single allocation - none once the
+ * decoder's arena has a recycled buffer of the size class.
+*/
+static zwsdecoder_buffer_t* zwsdecoder_buffer_new(zwsdecoder_t* decoder, zframe_t* frame, size_t size) {
+	zwsdecoder_buffer_t* self = size <= SIZE_MAX - sizeof(zwsdecoder_buffer_t) ? zwsarena_alloc(decoder->arena, sizeof(zwsdecoder_buffer_t) + size) : NULL;
+	if (self == NULL) {
+		return NULL;
+	}
+	self->refs = 1;
+	self->frame = frame;
+	return self;
+}
 
-	if (self->payload != NULL) {
-		free(self->payload);
-		self->payload = NULL;
+void zwsdecoder_buffer_retain(zwsdecoder_buffer_t* self) {
+	ZWS_ATOMIC_INC(self->refs);
+}
+
+void zwsdecoder_buffer_release(void* data, void* hint) {
+	zwsdecoder_buffer_t* self = (zwsdecoder_buffer_t*)hint;
+
+	// Retained payloads may be released from the application thread
+	if (ZWS_ATOMIC_DEC(self->refs) == 0) {
+		zframe_destroy(&self->frame);
+		zwsarena_free(self);
 	}
 }
 
 bool zwsdecoder_is_errored(zwsdecoder_t* self) {
 	return self->state == STATE_ERROR;
 }
+
+void zwsdecoder_set_max_message_size(zwsdecoder_t* self, size_t max_message_size) {
+	self->max_message_size = max_message_size;
+}
+
+void zwsdecoder_set_fragment_callback(zwsdecoder_t* self, fragment_callback_t fragment_cb) {
+	self->fragment_cb = fragment_cb;
+}
+
+void zwsdecoder_set_arena(zwsdecoder_t* self, zwsarena_t* arena) {
+	self->arena = arena;
+}
+
+void zwsdecoder_set_permessage_deflate(zwsdecoder_t* self, bool permessage_deflate) {
+	self->permessage_deflate = permessage_deflate;
+}
+
+bool zwsdecoder_is_compressed(zwsdecoder_t* self) {
+	return self->compressed;
+}
+
+byte* zwsdecoder_inflate(z_stream* stream, byte* data, size_t length, bool final, size_t size_hint, size_t* inflated_length) {
+	/* 7.2.2.  Decompression */
+	static byte tail[4] = { 0x00, 0x00, 0xff, 0xff };
+
+	size_t capacity = size_hint > INFLATE_MIN_BUFFER ? size_hint : INFLATE_MIN_BUFFER;
+	size_t used = 0;
+	byte* buffer = (byte *)malloc(capacity);
+	if (buffer == NULL) {
+		return NULL;
+	}
+
+	// The payload, then the tail that ends the message
+	for (int part = 0; part < (final ? 2 : 1); part++) {
+		byte* input = part == 0 ? data : tail;
+		size_t remaining = part == 0 ? length : sizeof(tail);
+
+		do {
+			// zlib counts bytes in 32 bits, larger payloads are fed in slices
+			uInt slice = remaining > UINT_MAX ? UINT_MAX : (uInt)remaining;
+			stream->avail_in = slice;
+			stream->next_in = input;
+			input += slice;
+			remaining -= slice;
+
+			do {
+				if (used == capacity) {
+					byte* grown = capacity <= SIZE_MAX / 2 ? (byte *)realloc(buffer, capacity * 2) : NULL;
+					if (grown == NULL) {
+						free(buffer);
+						return NULL;
+					}
+					buffer = grown;
+					capacity *= 2;
+				}
+
+				uInt room = capacity - used > UINT_MAX ? UINT_MAX : (uInt)(capacity - used);
+				stream->avail_out = room;
+				stream->next_out = buffer + used;
+
+				int rc = inflate(stream, Z_NO_FLUSH);
+				assert(rc != Z_STREAM_ERROR);
+				used += room - stream->avail_out;
+
+				switch (rc) {
+					case Z_NEED_DICT:
+					case Z_DATA_ERROR:
+					case Z_MEM_ERROR:
+						free(buffer);
+						return NULL;
+					default:
+						break;
+				}
+			} while (stream->avail_out == 0);
+		} while (remaining > 0);
+	}
+
+	// Give back most of an estimate that was far too large
+	if (used < capacity / 2 && capacity > 4096) {
+		byte* shrunk = (byte *)realloc(buffer, used > 0 ? used : 1);
+		buffer = shrunk != NULL ? shrunk : buffer;
+	}
+
+	*inflated_length = used;
+	return buffer;
+}
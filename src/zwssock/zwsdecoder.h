@@ -2,11 +2,17 @@
 #define ZWSDECODER_H_
 
 #include <czmq.h>
+#include <zlib.h>
+#include "zwsarena.h"
 
-typedef void (*message_callback_t)(void* tag, byte* payload, int length);
-typedef void(*close_callback_t)(void* tag, byte* payload, int length);
-typedef void(*ping_callback_t)(void* tag, byte* payload, int length);
-typedef void(*pong_callback_t)(void* tag, byte* payload, int length);
+// Reference counted memory holding a decoded payload, see zwsdecoder_buffer_retain
+typedef struct _zwsdecoder_buffer_t zwsdecoder_buffer_t;
+
+typedef void (*message_callback_t)(void* tag, byte* payload, size_t length, zwsdecoder_buffer_t* buffer);
+typedef void (*fragment_callback_t)(void* tag, byte* payload, size_t length, zwsdecoder_buffer_t* buffer, bool first, bool final);
+typedef void(*close_callback_t)(void* tag, byte* payload, size_t length);
+typedef void(*ping_callback_t)(void* tag, byte* payload, size_t length);
+typedef void(*pong_callback_t)(void* tag, byte* payload, size_t length);
 
 typedef struct _zwsdecoder_t zwsdecoder_t;
 
@@ -14,10 +20,36 @@ zwsdecoder_t* zwsdecoder_new(void* tag, message_callback_t message_cb, close_cal
 
 void zwsdecoder_destroy(zwsdecoder_t** self_p);
 
-void zwsdecoder_process_buffer(zwsdecoder_t* self, zframe_t* data);
+void zwsdecoder_process_buffer(zwsdecoder_t* self, zframe_t** data_p);
 
 bool zwsdecoder_is_errored(zwsdecoder_t* self);
 
+// Largest data message accepted, summed over its fragments; 0 for no limit
+void zwsdecoder_set_max_message_size(zwsdecoder_t* self, size_t max_message_size);
+
+// Hand each data frame to `fragment_cb` as it arrives instead of reassembling fragmented messages
+void zwsdecoder_set_fragment_callback(zwsdecoder_t* self, fragment_callback_t fragment_cb);
+
+// Take payload buffers from `arena` (owned by the decoding thread) instead of the heap
+void zwsdecoder_set_arena(zwsdecoder_t* self, zwsarena_t* arena);
+
+// Accept compressed data messages (RSV1 set), once the client negotiated permessage-deflate
+void zwsdecoder_set_permessage_deflate(zwsdecoder_t* self, bool permessage_deflate);
+
+// Whether the data message handed to the message or fragment callback is compressed
+bool zwsdecoder_is_compressed(zwsdecoder_t* self);
+
+// Inflate a permessage-deflate payload (or a fragment of one) with `stream` into one buffer, adding the
+// 00 00 ff ff tail when `final`. The buffer starts at `size_hint` bytes and doubles while needed.
+// Returns it (the caller frees it) with the inflated length, or NULL if the data can't be inflated
+byte* zwsdecoder_inflate(z_stream* stream, byte* data, size_t length, bool final, size_t size_hint, size_t* inflated_length);
+
+// Keep a payload's memory alive after the message callback returns
+void zwsdecoder_buffer_retain(zwsdecoder_buffer_t* self);
+
+// Drop a reference taken with zwsdecoder_buffer_retain; matches zmq_free_fn, with the buffer as hint
+void zwsdecoder_buffer_release(void* data, void* hint);
+
 #ifdef __cplusplus
 extern "C" {
 #endif
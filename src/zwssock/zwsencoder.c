@@ -0,0 +1,108 @@
+#include <limits.h>
+
+#include "zwsencoder.h"
+
+#define DEFLATE_FLUSH_RESERVE 16  // Empty stored block of the sync flush, and bits pending from the flag byte
+
+
+// Private methods
+static size_t zwsencoder_deflate(z_stream* stream, const byte* data, size_t length, byte* compressed, size_t available, int flush);
+
+
+/**
+ * Compute the message header frame
+*/
+void zwsencoder_compute_frame_header(byte header, uint64_t payload_length, uint64_t* frame_size, int* payload_start_index, byte* outgoing_data) {
+	*frame_size = 2 + payload_length;
+	*payload_start_index = 2;
+
+	if (payload_length > 125) {
+		*frame_size += 2;
+		*payload_start_index += 2;
+
+		if (payload_length > 0xFFFF) { // 2 bytes max value
+			*frame_size += 6;
+			*payload_start_index += 6;
+		}
+	}
+
+	outgoing_data[0] = header;
+
+	// No mask
+	outgoing_data[1] = 0x00;
+
+	if (payload_length <= 125) {
+		outgoing_data[1] |= (byte)(payload_length & 127);
+	} else if (payload_length <= 0xFFFF) { // maximum size of short
+		outgoing_data[1] |= 126;
+		outgoing_data[2] = (payload_length >> 8) & 0xFF;
+		outgoing_data[3] = payload_length & 0xFF;
+	} else {
+		outgoing_data[1] |= 127;
+		for (int i = 0; i < 8; i++) {
+			outgoing_data[2 + i] = (payload_length >> (56 - 8 * i)) & 0xFF;
+		}
+	}
+}
+
+/**
+ * Largest deflated size of a `length` byte message, 00 00 ff ff tail included
+ *
+ * deflateBound assumes a single Z_FINISH; the sync flush adds an empty stored block, and the flag byte
+ * deflated ahead of the message may leave a few bits pending, hence the reserve.
+*/
+size_t zwsencoder_deflate_bound(z_stream* stream, size_t length) {
+	size_t bound;
+	if (length <= ULONG_MAX) {
+		bound = deflateBound(stream, (uLong)length);
+	} else {
+		// uLong is 32 bits on some platforms, use zlib's bound for any parameters
+		bound = length + ((length + 7) >> 3) + ((length + 63) >> 6) + 11;
+	}
+	return bound + DEFLATE_FLUSH_RESERVE;
+}
+
+/**
+ * Deflate an outgoing message
+ *
+ * The JSMQ flag byte is deflated first, then the message is flushed so it ends on a byte boundary
+ * with the 00 00 ff ff tail, which is left out as per RFC 7692 7.2.1.
+*/
+size_t zwsencoder_deflate_message(z_stream* stream, byte flag, const byte* data, size_t length, byte* compressed) {
+	size_t available = zwsencoder_deflate_bound(stream, length + 1);
+
+	size_t payload_length = zwsencoder_deflate(stream, &flag, 1, compressed, available, Z_NO_FLUSH);
+	payload_length += zwsencoder_deflate(stream, data, length, compressed + payload_length, available - payload_length, Z_SYNC_FLUSH);
+	assert(stream->avail_in == 0);
+
+	return payload_length - 4; /* skip the 0x00 0x00 0xff 0xff */
+}
+
+/**
+ * Deflate `length` bytes into `compressed`, which has room for `available` bytes
+ *
+ * Returns the number of bytes written.
+*/
+static size_t zwsencoder_deflate(z_stream* stream, const byte* data, size_t length, byte* compressed, size_t available, int flush) {
+	size_t written = 0;
+
+	do {
+		// zlib counts bytes in 32 bits, larger messages are fed in slices
+		uInt slice = length > UINT_MAX ? UINT_MAX : (uInt)length;
+		stream->avail_in = slice;
+		stream->next_in = (byte*)data;
+		data += slice;
+		length -= slice;
+
+		do {
+			uInt room = available - written > UINT_MAX ? UINT_MAX : (uInt)(available - written);
+			stream->avail_out = room;
+			stream->next_out = compressed + written;
+
+			deflate(stream, length > 0 ? Z_NO_FLUSH : flush);
+			written += room - stream->avail_out;
+		} while (stream->avail_out == 0 && written < available);
+	} while (length > 0);
+
+	return written;
+}
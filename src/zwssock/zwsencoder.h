@@ -0,0 +1,26 @@
+#ifndef ZWSENCODER_H_
+#define ZWSENCODER_H_
+
+#include <czmq.h>
+#include <zlib.h>
+
+// Write the header of an unmasked frame (at most 10 bytes) to `outgoing_data`, along with the size
+// of the whole frame and the offset of its payload
+void zwsencoder_compute_frame_header(byte header, uint64_t payload_length, uint64_t* frame_size, int* payload_start_index, byte* outgoing_data);
+
+// Room needed to deflate `length` bytes with `stream`, however incompressible they are
+size_t zwsencoder_deflate_bound(z_stream* stream, size_t length);
+
+// Deflate a message (JSMQ flag byte, then `data`) with `stream` into `compressed`, which holds at least
+// zwsencoder_deflate_bound(stream, length + 1) bytes. Returns the compressed length, without the 00 00 ff ff tail
+size_t zwsencoder_deflate_message(z_stream* stream, byte flag, const byte* data, size_t length, byte* compressed);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // ZWSENCODER_H_
@@ -44,6 +44,14 @@ struct _zwshandshake_t {
 	zhash_t* header_fields;
 };
 
+// Parameters of a permessage-deflate offer, 0 / false when absent
+typedef struct {
+	int server_max_window_bits;
+	int client_max_window_bits;     // -1 when present without a value
+	bool server_no_context_takeover;
+	bool client_no_context_takeover;
+} deflate_offer_t;
+
 bool zwshandshake_validate(zwshandshake_t* self);
 
 zwshandshake_t* zwshandshake_new() {
@@ -327,9 +335,192 @@ int encode_base64(const uint8_t* in, int in_len, char* out, int out_len) {
 
 }
 
-zframe_t* zwshandshake_get_response(zwshandshake_t* self, unsigned char* client_compression_factor, unsigned char* server_compression_factor) {
+static bool s_is_token_char(char c) {
+	return c > 32 && c < 127 && strchr("()<>@,;:\\\"/[]?={}", c) == NULL;
+}
+
+static const char* s_skip_space(const char* p) {
+	while (*p == ' ' || *p == '\t') {
+		p++;
+	}
+	return p;
+}
+
+/**
+ * Read a parameter value, a token or a quoted string, into `value`
+ *
+ * Returns false if it is malformed or doesn't fit.
+*/
+static bool s_parse_value(const char** p, char* value, size_t size) {
+	const char* c = *p;
+	size_t length = 0;
+
+	if (*c == '"') {
+		c++;
+		while (*c != '"') {
+			if (*c == '\\') {
+				c++;
+			}
+			if (*c == 0 || length + 1 >= size) {
+				return false;
+			}
+			value[length++] = *c++;
+		}
+		c++;
+	} else {
+		while (s_is_token_char(*c)) {
+			if (length + 1 >= size) {
+				return false;
+			}
+			value[length++] = *c++;
+		}
+	}
+
+	value[length] = 0;
+	*p = c;
+	return length > 0;
+}
+
+/**
+ * Window size parameter value, 8 to 15, or -1 if invalid
+*/
+static int s_window_bits(const char* value) {
+	if (strlen(value) > 2 || !isdigit((unsigned char)value[0]) || (value[1] != 0 && !isdigit((unsigned char)value[1]))) {
+		return -1;
+	}
+	int bits = atoi(value);
+	return bits >= 8 && bits <= 15 ? bits : -1;
+}
+
+/**
+ * Record a permessage-deflate parameter, returning false for unknown, repeated or invalid ones (7.1)
+*/
+static bool s_parse_deflate_param(deflate_offer_t* offer, const char* name, size_t name_length, const char* value) {
+	if (name_length == strlen("server_no_context_takeover") && strncmp(name, "server_no_context_takeover", name_length) == 0) {
+		if (value != NULL || offer->server_no_context_takeover) {
+			return false;
+		}
+		offer->server_no_context_takeover = true;
+
+	} else if (name_length == strlen("client_no_context_takeover") && strncmp(name, "client_no_context_takeover", name_length) == 0) {
+		if (value != NULL || offer->client_no_context_takeover) {
+			return false;
+		}
+		offer->client_no_context_takeover = true;
+
+	} else if (name_length == strlen("server_max_window_bits") && strncmp(name, "server_max_window_bits", name_length) == 0) {
+		if (value == NULL || offer->server_max_window_bits != 0) {
+			return false;
+		}
+		offer->server_max_window_bits = s_window_bits(value);
+		return offer->server_max_window_bits > 0;
+
+	} else if (name_length == strlen("client_max_window_bits") && strncmp(name, "client_max_window_bits", name_length) == 0) {
+		if (offer->client_max_window_bits != 0) {
+			return false;
+		}
+		offer->client_max_window_bits = value != NULL ? s_window_bits(value) : -1;
+		return value == NULL || offer->client_max_window_bits > 0;
+
+	} else {
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Parse one extension offer of a Sec-WebSocket-Extensions list (RFC 6455 9.1) and move past it
+ *
+ * Returns false if the offer is malformed, or is a permessage-deflate offer with invalid parameters.
+*/
+static bool s_parse_offer(const char** list, bool* is_deflate, deflate_offer_t* offer) {
+	const char* p = s_skip_space(*list);
+	memset(offer, 0, sizeof(deflate_offer_t));
+
+	size_t length = 0;
+	while (s_is_token_char(p[length])) {
+		length++;
+	}
+	*is_deflate = length == strlen("permessage-deflate") && strncmp(p, "permessage-deflate", length) == 0;
+	bool valid = length > 0;
+	p += length;
+
+	while (valid) {
+		p = s_skip_space(p);
+		if (*p != ';') {
+			valid = *p == ',' || *p == 0;
+			break;
+		}
+
+		p = s_skip_space(p + 1);
+		const char* name = p;
+		while (s_is_token_char(*p)) {
+			p++;
+		}
+		size_t name_length = p - name;
+		p = s_skip_space(p);
+
+		char value[16];
+		bool has_value = *p == '=';
+		if (has_value) {
+			p = s_skip_space(p + 1);
+			valid = s_parse_value(&p, value, sizeof(value));
+		}
+
+		// Parameters of other extensions are none of our business
+		valid = valid && name_length > 0 && (!*is_deflate || s_parse_deflate_param(offer, name, name_length, has_value ? value : NULL));
+	}
+
+	// On to the next offer, skipping what is left of an invalid one
+	bool quoted = false;
+	while (*p != 0 && (quoted || *p != ',')) {
+		if (*p == '\\' && quoted && p[1] != 0) {
+			p++;
+		} else if (*p == '"') {
+			quoted = !quoted;
+		}
+		p++;
+	}
+	*list = *p == ',' ? p + 1 : p;
+	return valid;
+}
+
+/**
+ * Accept a permessage-deflate offer with the server's preferences, within the limits the client set (7.1)
+ *
+ * Returns false if the offer can't be accepted.
+*/
+static bool s_accept_deflate_offer(const deflate_offer_t* offer, const zwshandshake_deflate_t* preferred, zwshandshake_deflate_t* agreed) {
+	// zlib can't deflate a raw stream with an 8 bit window
+	int server_bits = preferred->server_max_window_bits;
+	if (offer->server_max_window_bits > 0 && offer->server_max_window_bits < server_bits) {
+		server_bits = offer->server_max_window_bits;
+	}
+	if (server_bits < 9) {
+		return false;
+	}
+
+	// The client's window can only be limited if it says it supports that
+	int client_bits = 15;
+	if (offer->client_max_window_bits != 0) {
+		client_bits = preferred->client_max_window_bits;
+		if (offer->client_max_window_bits > 0 && offer->client_max_window_bits < client_bits) {
+			client_bits = offer->client_max_window_bits;
+		}
+	}
+
+	agreed->enabled = true;
+	agreed->server_max_window_bits = (unsigned char)server_bits;
+	agreed->client_max_window_bits = (unsigned char)client_bits;
+	agreed->server_no_context_takeover = offer->server_no_context_takeover || preferred->server_no_context_takeover;
+	agreed->client_no_context_takeover = offer->client_no_context_takeover || preferred->client_no_context_takeover;
+	return true;
+}
+
+zframe_t* zwshandshake_get_response(zwshandshake_t* self, const zwshandshake_deflate_t* preferred, zwshandshake_deflate_t* agreed) {
 	const char* sec_websocket_key_name = "sec-websocket-key";
 	const char* magic_string = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+	memset(agreed, 0, sizeof(zwshandshake_deflate_t));
 
 	char* key = zhash_lookup(self->header_fields, sec_websocket_key_name);
 	if (key == NULL) return NULL;
@@ -354,88 +545,38 @@ zframe_t* zwshandshake_get_response(zwshandshake_t* self, unsigned char* client_
 
 	if (accept_key_len == -1) return NULL;
 
-	// this is a proof of concept implementation, similar to zwshandshake_parse_request
-	// it only implements the bare minimum to get compression going, consider it a TODO
-	// to implement a proper parsing of both HTTP Headers as sec-websocket-extensions list.
-
-	/* Implementation of permessage-deflate, client_compression_factor and server_compression_factor */
-	const char* sec_websocket_extensions_name = "sec-websocket-extensions";
-	bool extension_permessage_deflate = false;
-	bool extension_client_compression_factor = false;
-	bool extension_server_compression_factor = false;
-
-	char* key_extensions = zhash_lookup(self->header_fields, sec_websocket_extensions_name);
-	if (key_extensions) {
-
-		if(strstr(key_extensions, "permessage-deflate") != NULL &&
-				*client_compression_factor > 0 && *server_compression_factor > 0) {
-			extension_permessage_deflate = true;
-
-			// Parse client compression factor
-			char* client_factor = strstr(key_extensions, "client_compression_factor");
-			char* client_max_bits = strstr(key_extensions, "client_max_window_bits");
-
-			if (client_factor != NULL) {
-				extension_client_compression_factor = true;
-			} else {
-				*client_compression_factor = 15;
-			}
-
-			if (client_max_bits != NULL) {
-				char* client_bits_specified = strstr(key_extensions, "client_max_window_bits=");
-
-				if (client_bits_specified) {
-					extension_client_compression_factor = true;
-					*client_compression_factor = 15;
-
-				} else {
-					extension_client_compression_factor = false;
-					*client_compression_factor = 15;
-				}
-			} else {
-				*client_compression_factor = 15;
+	char extension[192] = { 0 };
+
+	char* key_extensions = zhash_lookup(self->header_fields, "sec-websocket-extensions");
+	if (key_extensions && preferred->enabled) {
+		// Offers are listed in the client's order of preference
+		const char* offers = key_extensions;
+		while (*offers != 0 && !agreed->enabled) {
+			bool is_deflate;
+			deflate_offer_t offer;
+			bool valid = s_parse_offer(&offers, &is_deflate, &offer);
+			if (valid && is_deflate) {
+				s_accept_deflate_offer(&offer, preferred, agreed);
 			}
+		}
+	}
 
-			// Parse server compression factor
-			char* factor_str = strstr(key_extensions, "server_compression_factor=");
-			if (factor_str) {
-				extension_server_compression_factor = true;
-
-				long int server_compression_factor_candidate = strtol(factor_str + sizeof("server_compression_factor="), NULL, 10);
-
-				// Correct compression factor if it is out of bounds
-				if (server_compression_factor_candidate >= 8 || server_compression_factor_candidate <= 15) {
-					*server_compression_factor = (unsigned char) (server_compression_factor_candidate & 15);
-				} else {
-					*server_compression_factor = server_compression_factor_candidate;
-				}
-
-			} else {
-				extension_server_compression_factor = false;
-			}
-		} else {
-			*client_compression_factor = 0;
-			*server_compression_factor = 0;
-		}  // end if (strstr(key_extensions, "permessage-deflate") != NULL)
-	}  // end if (key_extensions)
-
-	char extension[128] = { 0 };
-
-	if (extension_permessage_deflate) {
-		if (extension_client_compression_factor && extension_server_compression_factor) {
-			snprintf(extension, 128, "Sec-WebSocket-Extensions: permessage-deflate); client_compression_factor=%d; server_compression_factor=%d\r\n", *client_compression_factor, *server_compression_factor);
-		} else if (extension_client_compression_factor) {
-			snprintf(extension, 128, "Sec-WebSocket-Extensions: permessage-deflate); client_compression_factor=%d\r\n", *client_compression_factor);
-		} else if (extension_server_compression_factor) {
-			snprintf(extension, 128, "Sec-WebSocket-Extensions: permessage-deflate); server_compression_factor=%d\r\n", *server_compression_factor);
-		} else {
-			strncpy(extension, "Sec-WebSocket-Extensions: permessage-deflate\r\n", 128);
+	if (agreed->enabled) {
+		// The server's window is always stated, as an offer limiting it must see it in the response;
+		// the client's only when limited, which the offer allowed
+		int length = snprintf(extension, sizeof(extension), "Sec-WebSocket-Extensions: permessage-deflate%s%s; server_max_window_bits=%d",
+			agreed->server_no_context_takeover ? "; server_no_context_takeover" : "",
+			agreed->client_no_context_takeover ? "; client_no_context_takeover" : "",
+			agreed->server_max_window_bits);
+		if (agreed->client_max_window_bits < 15) {
+			length += snprintf(extension + length, sizeof(extension) - length, "; client_max_window_bits=%d", agreed->client_max_window_bits);
 		}
+		snprintf(extension + length, sizeof(extension) - length, "\r\n");
 	}
 
-	char response[256];
+	char response[384];
 
-	int response_len = snprintf(response, 256, "HTTP/1.1 101 Switching Protocols\r\n"
+	int response_len = snprintf(response, sizeof(response), "HTTP/1.1 101 Switching Protocols\r\n"
 	                                           "Upgrade: websocket\r\n"
 	                                           "Connection: Upgrade\r\n"
 	                                           "Sec-WebSocket-Accept: %s\r\n"
@@ -5,13 +5,24 @@
 
 typedef struct _zwshandshake_t zwshandshake_t;
 
+// permessage-deflate parameters (RFC 7692): the server's preferences going into zwshandshake_get_response,
+// and what was agreed with the client coming out
+typedef struct {
+	bool enabled;                          // Compression offered by the server, or accepted
+	unsigned char server_max_window_bits;  // Window of the server's deflater, 9 to 15
+	unsigned char client_max_window_bits;  // Window of the client's deflater, 8 to 15
+	bool server_no_context_takeover;       // The server resets its deflater after each message
+	bool client_no_context_takeover;       // The client resets its deflater after each message
+} zwshandshake_deflate_t;
+
 zwshandshake_t* zwshandshake_new();
 
 void zwshandshake_destroy(zwshandshake_t** self_p);
 
 bool zwshandshake_parse_request(zwshandshake_t* self, zframe_t* data);
 
-zframe_t* zwshandshake_get_response(zwshandshake_t* self, unsigned char* client_compression_factor, unsigned char* server_compression_factor);
+// Accepts the client's first permessage-deflate offer that fits `preferred` into `agreed`, if any
+zframe_t* zwshandshake_get_response(zwshandshake_t* self, const zwshandshake_deflate_t* preferred, zwshandshake_deflate_t* agreed);
 
 #ifdef __cplusplus
 extern "C" {
@@ -0,0 +1,143 @@
+#include "zwspool.h"
+
+// Jobs travel as pointers over a pair per thread, so the owner and the thread never share a queue
+typedef struct {
+	zwspool_fn* run_fn;
+	zsock_t* jobs;              // Owner's end of the thread's pair
+	zactor_t* actor;
+	size_t pending;
+	char endpoint[64];
+} zwspool_thread_t;
+
+struct _zwspool_t {
+	zwspool_thread_t* threads;
+	size_t size;
+	size_t pending;
+	size_t next;                // Thread to look at first for a finished job, so that none is starved
+};
+
+
+// Private methods
+static void s_zwspool_task(zsock_t* pipe, void* args);
+static void* zwspool_receive(zwspool_t* self, size_t thread);
+
+
+zwspool_t* zwspool_new(size_t threads, zwspool_fn* run_fn) {
+	zwspool_t* self = zmalloc(sizeof(zwspool_t));
+	self->threads = (zwspool_thread_t *)zmalloc(threads * sizeof(zwspool_thread_t));
+	self->size = threads;
+
+	for (size_t i = 0; i < threads; i++) {
+		zwspool_thread_t* thread = &self->threads[i];
+		thread->run_fn = run_fn;
+		thread->jobs = zsock_new(ZMQ_PAIR);
+
+		// Submitting must never block on a thread that is itself blocked returning jobs
+		zsock_set_sndhwm(thread->jobs, 0);
+		zsock_set_rcvhwm(thread->jobs, 0);
+		snprintf(thread->endpoint, sizeof(thread->endpoint), "inproc://zwspool-%p", (void *)thread->jobs);
+		int rc = zsock_bind(thread->jobs, "%s", thread->endpoint);
+		assert(rc != -1);
+
+		thread->actor = zactor_new(s_zwspool_task, thread);
+	}
+	return self;
+}
+
+void zwspool_destroy(zwspool_t** self_p) {
+	zwspool_t* self = *self_p;
+	if (self) {
+		for (size_t i = 0; i < self->size; i++) {
+			zactor_destroy(&self->threads[i].actor);
+			zsock_destroy(&self->threads[i].jobs);
+		}
+		free(self->threads);
+		free(self);
+		*self_p = NULL;
+	}
+}
+
+size_t zwspool_size(zwspool_t* self) {
+	return self->size;
+}
+
+void zwspool_submit(zwspool_t* self, size_t thread, void* job) {
+	assert(thread < self->size);
+	int rc = zmq_send(zsock_resolve(self->threads[thread].jobs), &job, sizeof(job), 0);
+	assert(rc == sizeof(job));
+	self->threads[thread].pending++;
+	self->pending++;
+}
+
+size_t zwspool_pending(zwspool_t* self) {
+	return self->pending;
+}
+
+void* zwspool_done(zwspool_t* self) {
+	for (size_t n = 0; n < self->size && self->pending > 0; n++) {
+		size_t thread = (self->next + n) % self->size;
+		if (self->threads[thread].pending > 0 && (zsock_events(self->threads[thread].jobs) & ZMQ_POLLIN)) {
+			self->next = (thread + 1) % self->size;
+			return zwspool_receive(self, thread);
+		}
+	}
+	return NULL;
+}
+
+void* zwspool_wait(zwspool_t* self) {
+	void* job = zwspool_done(self);
+	for (size_t thread = 0; job == NULL && thread < self->size; thread++) {
+		if (self->threads[thread].pending > 0) {
+			job = zwspool_receive(self, thread);
+		}
+	}
+	return job;
+}
+
+zsock_t* zwspool_socket(zwspool_t* self, size_t thread) {
+	assert(thread < self->size);
+	return self->threads[thread].jobs;
+}
+
+static void* zwspool_receive(zwspool_t* self, size_t thread) {
+	void* job;
+	int rc = zmq_recv(zsock_resolve(self->threads[thread].jobs), &job, sizeof(job), 0);
+	assert(rc == sizeof(job));
+	self->threads[thread].pending--;
+	self->pending--;
+	return job;
+}
+
+/**
+ * Run the jobs arriving on the thread's pair and send each one back when done
+*/
+static void s_zwspool_task(zsock_t* pipe, void* args) {
+	zwspool_thread_t* thread = (zwspool_thread_t *)args;
+
+	zsock_t* jobs = zsock_new(ZMQ_PAIR);
+	zsock_set_sndhwm(jobs, 0);
+	zsock_set_rcvhwm(jobs, 0);
+	int rc = zsock_connect(jobs, "%s", thread->endpoint);
+	assert(rc != -1);
+	zsock_signal(pipe, 0);
+
+	zpoller_t* poller = zpoller_new(pipe, jobs, NULL);
+	void* handle = zsock_resolve(jobs);
+
+	while (true) {
+		void* which = zpoller_wait(poller, -1);
+		if (which != jobs) {
+			// $TERM, or interrupted
+			break;
+		}
+
+		void* job;
+		while (zmq_recv(handle, &job, sizeof(job), ZMQ_DONTWAIT) == sizeof(job)) {
+			thread->run_fn(job);
+			zmq_send(handle, &job, sizeof(job), 0);
+		}
+	}
+
+	zpoller_destroy(&poller);
+	zsock_destroy(&jobs);
+}
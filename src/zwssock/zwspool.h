@@ -0,0 +1,42 @@
+#ifndef ZWSPOOL_H_
+#define ZWSPOOL_H_
+
+#include <czmq.h>
+
+// Pool of threads running jobs for one owner thread; each thread runs its jobs in order
+typedef struct _zwspool_t zwspool_t;
+
+typedef void (zwspool_fn)(void* job);
+
+// Every job is run by `run_fn` on the thread it was submitted to
+zwspool_t* zwspool_new(size_t threads, zwspool_fn* run_fn);
+
+// Jobs still pending are not freed, wait for them first
+void zwspool_destroy(zwspool_t** self_p);
+
+size_t zwspool_size(zwspool_t* self);
+
+// Jobs submitted to the same thread are run, and come back, in submission order
+void zwspool_submit(zwspool_t* self, size_t thread, void* job);
+
+// Jobs submitted and not yet returned by zwspool_done or zwspool_wait
+size_t zwspool_pending(zwspool_t* self);
+
+// Returns a finished job, or NULL if none is ready, without blocking
+void* zwspool_done(zwspool_t* self);
+
+// Returns a finished job, waiting for one; NULL if no job is pending
+void* zwspool_wait(zwspool_t* self);
+
+// Socket signalling the jobs a thread finished, for the owner's poller
+zsock_t* zwspool_socket(zwspool_t* self, size_t thread);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // ZWSPOOL_H_
@@ -1,6 +1,12 @@
 #include "zwssock.h"
 #include "zwshandshake.h"
 #include "zwsdecoder.h"
+#include "zwsencoder.h"
+#include "zwstrie.h"
+#include "zwstable.h"
+#include "zwspool.h"
+#include "zwscache.h"
+#include "zwszlib.h"
 
 #include <czmq.h>
 #include <string.h>
@@ -17,22 +23,21 @@
 struct _zwssock_t {
 	zactor_t* control_actor;              										//  Control to / from agent
 	zsock_t* data;                 														//  Data to / from agent
+	bool binary_routing_id;                                   //  Clients are identified by routing ID, see zwssock_set_binary_routing_id
 };
 
 //  This background thread does all the real work
 static void s_agent_task(zsock_t* control, void* args);
 
 /**
- *
+ * Create a socket of `type`, ZMQ_ROUTER or ZMQ_PUB
 */
-
-
-zwssock_t* zwssock_new_router() {
+static zwssock_t* s_zwssock_new(int type) {
 	zwssock_t* self = (zwssock_t *)zmalloc(sizeof(zwssock_t));
 
 	assert(self);
 
-	self->control_actor = zactor_new(s_agent_task, NULL);
+	self->control_actor = zactor_new(s_agent_task, (void *)(intptr_t)type);
 
 	//  Create separate data socket, send address on control socket
 	self->data = zsock_new(ZMQ_PAIR);
@@ -44,6 +49,25 @@ zwssock_t* zwssock_new_router() {
 	return self;
 }
 
+/**
+ * Create a router socket: messages from clients are received led by the client's hash key, and
+ * messages sent are led by the hash key of the client to send them to
+*/
+zwssock_t* zwssock_new_router() {
+	return s_zwssock_new(ZMQ_ROUTER);
+}
+
+/**
+ * Create a publisher socket: messages sent go to every client subscribed to a prefix of their first
+ * frame, encoded once for all of them
+ *
+ * Clients subscribe and unsubscribe (JSMQ SUBSCRIBER) with a message of a 1 or 0 byte followed by
+ * the prefix. Nothing is received from a publisher socket.
+*/
+zwssock_t* zwssock_new_publisher() {
+	return s_zwssock_new(ZMQ_PUB);
+}
+
 /**
  *
 */
@@ -79,6 +103,72 @@ int zwssock_send(zwssock_t* self, zmsg_t** msg_p) {
 	return zmsg_send(msg_p, self->data);
 }
 
+/**
+ * Send the same message to many clients, encoding it only once
+ *
+ * `clients` lists the hash keys of the clients, as received in the first frame of their messages,
+ * or is NULL to send to every connected client. The message goes through the data socket, in order
+ * with zwssock_send. Returns the number of clients the message was sent to, or -1 on error; if
+ * `failed_p` is given, it gets a list of the hash keys of the clients that weren't reached.
+ * With binary routing IDs (zwssock_set_binary_routing_id) both lists hold zframe_t IDs instead.
+*/
+int zwssock_broadcast(zwssock_t* self, zlist_t* clients, zmsg_t** msg_p, zlist_t** failed_p) {
+	assert(self);
+	assert(zmsg_size(*msg_p) > 0);
+
+	// Header: empty address, number of clients ("*" for all), their hash keys
+	zmsg_t* msg = *msg_p;
+	char count_str[32];
+	if (clients != NULL) {
+		for (void* client = zlist_first(clients); client != NULL; client = zlist_next(clients)) {
+			if (self->binary_routing_id) {
+				zmsg_pushmem(msg, zframe_data((zframe_t *)client), zframe_size((zframe_t *)client));
+			} else {
+				zmsg_pushstr(msg, (char *)client);
+			}
+		}
+		snprintf(count_str, sizeof(count_str), "%zu", zlist_size(clients));
+	} else {
+		snprintf(count_str, sizeof(count_str), "*");
+	}
+	zmsg_pushstr(msg, count_str);
+	zmsg_pushstr(msg, "");
+
+	if (zmsg_send(msg_p, self->data) == -1) {
+		return -1;
+	}
+
+	// The agent reports back once the message is sent
+	zmsg_t* report = zmsg_recv(self->control_actor);
+	if (report == NULL) {
+		return -1;
+	}
+	char* sent_str = zmsg_popstr(report);
+	int sent = sent_str ? atoi(sent_str) : -1;
+	free(sent_str);
+
+	if (failed_p) {
+		zlist_t* failed = zlist_new();
+		if (self->binary_routing_id) {
+			zlist_set_destructor(failed, (czmq_destructor *)zframe_destroy);
+			zframe_t* id;
+			while ((id = zmsg_pop(report)) != NULL) {
+				zlist_append(failed, id);
+			}
+		} else {
+			zlist_autofree(failed);
+			char* hashkey;
+			while ((hashkey = zmsg_popstr(report)) != NULL) {
+				zlist_append(failed, hashkey);
+				free(hashkey);
+			}
+		}
+		*failed_p = failed;
+	}
+	zmsg_destroy(&report);
+	return sent;
+}
+
 /**
  * Receive message from socket
 */
@@ -96,32 +186,387 @@ zsock_t* zwssock_handle(zwssock_t* self) {
 	return self->data;
 }
 
+/**
+ * Send an option to the agent, and wait until it is applied
+*/
+static void s_set_option(zwssock_t* self, const char* name, unsigned long long value) {
+	char value_str[32];
+	snprintf(value_str, sizeof(value_str), "%llu", value);
+	zstr_sendx(self->control_actor, "SET", name, value_str, NULL);
+	zsock_wait(self->control_actor);
+}
+
+/**
+ * Set the largest message accepted from a client, summed over its fragments (0 for no limit)
+ *
+ * Clients sending larger messages are disconnected. Compressed messages are measured as received.
+ * Defaults to 2 GB - 1, raise it to receive larger messages. Applies to clients connecting after the call.
+*/
+void zwssock_set_max_message_size(zwssock_t* self, size_t max_message_size) {
+	assert(self);
+	s_set_option(self, "max_message_size", max_message_size);
+}
+
+/**
+ * Pass fragmented messages on fragment by fragment instead of reassembling them
+ *
+ * Each fragment is inflated (if compressed) as it arrives and becomes its own frame of the message
+ * delivered to the application, so a large fragmented upload is never copied into one contiguous
+ * buffer. Applies to clients connecting after the call.
+*/
+void zwssock_set_fragment_streaming(zwssock_t* self, bool fragment_streaming) {
+	assert(self);
+	s_set_option(self, "fragment_streaming", fragment_streaming);
+}
+
+/**
+ * Split outgoing messages into WebSocket fragments of at most `fragment_size` payload bytes (0 to disable)
+ *
+ * Fragments of large messages are sent in turn with other clients' traffic, so one large message
+ * doesn't hold up the agent. Compressed messages are deflated whole and the result is fragmented.
+*/
+void zwssock_set_fragment_size(zwssock_t* self, size_t fragment_size) {
+	assert(self);
+	s_set_option(self, "fragment_size", fragment_size);
+}
+
+/**
+ * Set how much memory the agent may keep in recycled payload buffers (0 to allocate every buffer)
+ *
+ * Buffers up to 1 MB are taken from a size-classed pool shared by all clients and recycled once
+ * released, so steady traffic makes no allocations. Defaults to 32 MB.
+*/
+void zwssock_set_buffer_pool_size(zwssock_t* self, size_t buffer_pool_size) {
+	assert(self);
+	s_set_option(self, "buffer_pool_size", buffer_pool_size);
+}
+
+/**
+ * Set how much memory the agent may keep in slabs for zlib's windows and tables (0 to use the heap)
+ *
+ * zlib asks for the same few sizes for every context, so contexts are carved from slabs of blocks
+ * of those sizes and a connect after a disconnect reuses the memory it freed. Defaults to 64 MB.
+*/
+void zwssock_set_zlib_pool_size(zwssock_t* self, size_t zlib_pool_size) {
+	assert(self);
+	s_set_option(self, "zlib_pool_size", zlib_pool_size);
+}
+
+/**
+ * Set how much memory the agent may keep in compressed messages cached by content (0 to disable)
+ *
+ * Clients without server context takeover and with the same window size get the same compressed
+ * bytes for the same message, so a message sent to many of them is deflated once, when it is seen
+ * the second time, and the others share its frame. Defaults to 4 MB.
+*/
+void zwssock_set_deflate_cache_size(zwssock_t* self, size_t deflate_cache_size) {
+	assert(self);
+	s_set_option(self, "deflate_cache_size", deflate_cache_size);
+}
+
+/**
+ * Set how many payload bytes may wait for a client that reads slower than it is sent to (0 for no limit)
+ *
+ * Messages the stream socket can't take yet wait in the client's queue instead of blocking the agent.
+ * Once a client's queue would exceed this, or zwssock_set_outbound_queue_messages, the slow client
+ * policy applies. Defaults to 16 MB.
+*/
+void zwssock_set_outbound_queue_bytes(zwssock_t* self, size_t outbound_queue_bytes) {
+	assert(self);
+	s_set_option(self, "outbound_queue_bytes", outbound_queue_bytes);
+}
+
+/**
+ * Set how many WebSocket messages (JSMQ frames) may wait for a slow client (0, the default, for no limit)
+*/
+void zwssock_set_outbound_queue_messages(zwssock_t* self, size_t outbound_queue_messages) {
+	assert(self);
+	s_set_option(self, "outbound_queue_messages", outbound_queue_messages);
+}
+
+/**
+ * Set what happens to a message for a client whose outbound queue is full
+ *
+ * ZWSSOCK_DROP_NEWEST (the default) drops it, ZWSSOCK_DROP_OLDEST drops the oldest messages queued
+ * but the one being sent, ZWSSOCK_DISCONNECT drops the queue and closes the connection. Messages are
+ * dropped whole, never some of their frames.
+*/
+void zwssock_set_slow_client_policy(zwssock_t* self, zwssock_slow_client_policy_t policy) {
+	assert(self);
+	s_set_option(self, "slow_client_policy", (unsigned long long)policy);
+}
+
+/**
+ * Lead messages with the client's binary routing ID instead of its hex hash key
+ *
+ * The ID is a short fixed-width frame (5 bytes for a ZMQ_STREAM peer) that the application sends
+ * back as is, so neither side formats or parses hex. Set it before clients connect.
+*/
+void zwssock_set_binary_routing_id(zwssock_t* self, bool binary_routing_id) {
+	assert(self);
+	self->binary_routing_id = binary_routing_id;
+	s_set_option(self, "binary_routing_id", binary_routing_id);
+}
+
+/**
+ * Set how many messages the agent handles from each direction per wakeup (at least 1)
+ *
+ * Once woken up, the agent reads from clients and from the application in turn, without blocking,
+ * until neither has messages waiting or both have reached the batch size; then it polls again.
+ * Defaults to 64.
+*/
+void zwssock_set_batch_size(zwssock_t* self, size_t batch_size) {
+	assert(self);
+	s_set_option(self, "batch_size", batch_size);
+}
+
+/**
+ * Spread clients over `workers` threads, sharded by routing ID (0 to handle them all on the agent thread)
+ *
+ * Each worker decodes, inflates, deflates and frames the traffic of its own clients, keeping their
+ * messages in order and their zlib contexts on one thread; the agent thread only moves messages
+ * between the stream socket, the workers and the application. Broadcasts and published messages
+ * are encoded once per worker. Set it before binding, it can't be changed afterwards.
+*/
+void zwssock_set_workers(zwssock_t* self, size_t workers) {
+	assert(self);
+	s_set_option(self, "workers", workers);
+}
+
+/**
+ * Deflate and inflate messages of COMPRESSION_OFFLOAD_THRESHOLD bytes or more on `threads` compression
+ * threads instead of the agent thread (0, the default, to compress inline)
+ *
+ * Each client is bound to one compression thread, so its zlib contexts are only ever used by one
+ * thread at a time and its messages stay in order; smaller messages queued behind a large one wait
+ * for it. With worker threads, each worker gets its own compression threads. Set it before binding.
+*/
+void zwssock_set_compression_threads(zwssock_t* self, size_t threads) {
+	assert(self);
+	s_set_option(self, "compression_threads", threads);
+}
+
+/**
+ * Send messages under `threshold` bytes uncompressed, even to clients that negotiated permessage-deflate
+ * (0, the default, compresses them all)
+ *
+ * Deflating a short message costs more than it saves; RFC 7692 lets each message say whether it's compressed.
+*/
+void zwssock_set_compression_threshold(zwssock_t* self, size_t threshold) {
+	assert(self);
+	s_set_option(self, "compression_threshold", threshold);
+}
+
+/**
+ * Send messages uncompressed to a client while its messages compress to more than `percent` % of their size
+ * (0, the default, always compresses)
+ *
+ * The ratio is a running estimate per client; one message in 32 is still compressed to keep it current,
+ * so compression resumes when the payloads become compressible again.
+*/
+void zwssock_set_compression_ratio(zwssock_t* self, unsigned int percent) {
+	assert(self);
+	s_set_option(self, "compression_ratio", percent);
+}
+
+/**
+ * Accept permessage-deflate when clients offer it (the default), or never compress
+*/
+void zwssock_set_compression(zwssock_t* self, bool compression) {
+	assert(self);
+	s_set_option(self, "compression", compression);
+}
+
+/**
+ * Set the window of the server's deflaters, 9 to 15 bits (defaults to 10)
+ *
+ * A client may ask for a smaller one. A deflater takes about 2^(bits + 2) bytes of window, on top of
+ * its hash tables. Applies to clients connecting after the call.
+*/
+void zwssock_set_server_max_window_bits(zwssock_t* self, int bits) {
+	assert(self);
+	s_set_option(self, "server_max_window_bits", bits);
+}
+
+/**
+ * Ask clients to deflate with a window of at most 8 to 15 bits (defaults to 15)
+ *
+ * Only clients offering client_max_window_bits can be asked; the inflater of each client takes
+ * about 2^bits bytes. Applies to clients connecting after the call.
+*/
+void zwssock_set_client_max_window_bits(zwssock_t* self, int bits) {
+	assert(self);
+	s_set_option(self, "client_max_window_bits", bits);
+}
+
+/**
+ * Deflate each message on its own instead of referring back to the previous ones (server_no_context_takeover)
+ *
+ * Compresses worse when consecutive messages look alike. Clients that ask for it get it anyway.
+*/
+void zwssock_set_server_no_context_takeover(zwssock_t* self, bool no_context_takeover) {
+	assert(self);
+	s_set_option(self, "server_no_context_takeover", no_context_takeover);
+}
+
+/**
+ * Require clients to deflate each message on its own (client_no_context_takeover)
+*/
+void zwssock_set_client_no_context_takeover(zwssock_t* self, bool no_context_takeover) {
+	assert(self);
+	s_set_option(self, "client_no_context_takeover", no_context_takeover);
+}
+
+/**
+ * Set the zlib memLevel of the server's deflaters, 1 to 9 (defaults to 8)
+ *
+ * The hash tables take 2^(level + 9) bytes: 128 KB at 8, 8 KB at 4, at some cost in speed and ratio.
+*/
+void zwssock_set_deflate_mem_level(zwssock_t* self, int level) {
+	assert(self);
+	s_set_option(self, "deflate_mem_level", level);
+}
+
+/**
+ * Get the agent's counters
+ *
+ * With worker threads, these are the counters of the agent thread moving the messages, and the
+ * compression counters of all the workers.
+*/
+void zwssock_get_stats(zwssock_t* self, zwssock_stats_t* stats) {
+	assert(self);
+	assert(stats);
+	zstr_send(self->control_actor, "STATS");
+	zframe_t* reply = zframe_recv(self->control_actor);
+	assert(reply && zframe_size(reply) == sizeof(zwssock_stats_t));
+	memcpy(stats, zframe_data(reply), sizeof(zwssock_stats_t));
+	zframe_destroy(&reply);
+}
+
 
 //  *************************    BACK END AGENT    *************************
 
+#define DEFAULT_MAX_MESSAGE_SIZE 0x7FFFFFFF  // Largest message accepted before 64 bit lengths were supported
+#define DEFAULT_BUFFER_POOL_SIZE (32 * 1024 * 1024)
+#define DEFAULT_ZLIB_POOL_SIZE (64 * 1024 * 1024)
+#define DEFAULT_DEFLATE_CACHE_SIZE (4 * 1024 * 1024)
+#define DEFAULT_OUTBOUND_QUEUE_BYTES (16 * 1024 * 1024)
+#define DEFAULT_BATCH_SIZE 64
+#define DEFAULT_SERVER_MAX_WINDOW_BITS 10
+#define ZLIB_IDLE_CONTEXTS 16                // zlib contexts kept ready for clients without context takeover, and broadcasts
+#define COMPRESSION_OFFLOAD_THRESHOLD 4096   // Smaller messages are compressed on the agent thread, unless queued behind larger ones
+#define DEFLATE_PROBE_INTERVAL 32            // Messages sent uncompressed to an incompressible client between two compressed ones
+#define INFLATE_INITIAL_RATIO 64             // Expansion assumed for a client's first compressed message, in 1/16ths
+#define DEFLATE_BUFFER_KEPT (1024 * 1024)    // Larger deflate output buffers are released after use
+#define SEND_RETRY_INTERVAL 10               // Milliseconds between attempts to send to clients that stopped reading
+
 typedef struct {
+	int type;                                                 // ZMQ_ROUTER or ZMQ_PUB
 	zsock_t* control;              														// Control socket back to application
 	zsock_t* data;                 														// Data socket to application
-	zsock_t* stream;               														// Stream socket to server
-	zhash_t* clients;           															// Known clients
+	zsock_t* stream;               														// Stream socket to server, or a pair to the agent for a worker
+	zwstable_t* clients;                                      // Known clients, by routing ID
+	zpoller_t* poller;                                        // Agent loop poller, workers add their sockets to it
+
+	zactor_t** workers;                                       // Workers owning the clients, by routing ID hash (sharded mode)
+	zsock_t** worker_streams;                                 // Client traffic to and from each worker
+	zsock_t** worker_data;                                    // Application traffic to and from each worker
+	size_t worker_count;
+	zmsg_t* options;                                          // Options set so far, name and value, replayed to workers as they start
+	zmsg_t* broadcast_failed;                                 // Report of the broadcast waiting on workers
+	size_t broadcast_sent;
+	size_t broadcast_pending;                                 // Workers yet to report on the broadcast
+
+	zlist_t* sending;                                         // Clients with messages queued, or a close that waits to be sent
+	bool sending_stalled;                                     // None of them could be sent to on the last attempt
+	zwstable_t* held;                                         // Messages from the workers the stream socket refused, by routing ID (sharded mode)
+	zlist_t* deliveries;                                      // Messages to the application the data socket had no room for, oldest first
+	bool inbound_paused;                                      // Client traffic isn't read until the application catches up
+	zwsarena_t* arena;                                        // Payload buffers recycled between the clients' decoders
+	zwstrie_t* subscriptions;                                 // Clients by subscribed prefix (publisher)
+	zwspool_t* compressors;                                   // Threads compressing large messages, NULL to compress inline
+	zwszlib_t* zlib;                                          // zlib contexts lent to clients and broadcasts
+	zwscache_t* deflate_cache;                                // Compressed frames by content, for clients without context takeover
+	byte* deflate_buffer;                                     // Output of the messages deflated on the agent thread, one at a time
+	size_t deflate_buffer_size;
+	uint64_t publish_count;                                   // Messages published, to match each client once per message
+
+	size_t max_message_size;                                  // Largest message accepted from a client, 0 for no limit
+	bool fragment_streaming;                                  // Pass fragments on as they arrive instead of reassembling
+	size_t fragment_size;                                     // Largest payload sent in one frame, 0 for no fragmentation
+	bool binary_routing_id;                                   // Messages are led by the routing ID rather than the hash key
+	size_t batch_size;                                        // Messages handled from each direction per wakeup
+	size_t compression_threshold;                             // Smaller messages are sent uncompressed
+	uint32_t compression_ratio;                               // Largest compressed / original size worth compressing, in 1/1024ths; 0 for any
+	zwshandshake_deflate_t deflate;                           // permessage-deflate parameters offered to clients
+	int deflate_mem_level;                                    // zlib memLevel of the deflaters, 1 to 9
+	size_t outbound_queue_bytes;                              // Most payload bytes queued for a client, 0 for no limit
+	size_t outbound_queue_messages;                           // Most messages queued for a client, 0 for no limit
+	zwssock_slow_client_policy_t slow_client_policy;          // What to do once a client's queue is full
+
+	zwssock_stats_t stats;
 } agent_t;
 
+static void s_agent_destroy_clients(agent_t* self);
+static void s_agent_stop_compressors(agent_t* self);
+static void s_agent_destroy_held(agent_t* self);
+static void s_agent_destroy_deliveries(agent_t* self);
+static void s_agent_send_stream(agent_t* self, zmsg_t** msg_p);
+
 /**
  *
 */
-static agent_t* s_agent_new(zsock_t* control) {
+static agent_t* s_agent_new(zsock_t* control, int type) {
 	agent_t* self = (agent_t *)zmalloc(sizeof(agent_t));
+	self->type = type;
 	self->control = control;
-	self->stream = zsock_new(ZMQ_STREAM);
 
-	//  Connect our data socket to caller's endpoint
+	//  Connect our data socket to caller's endpoint; workers also get the endpoint of their stream pair
+	zmsg_t* endpoints = zmsg_recv(self->control);
+	char* endpoint = zmsg_popstr(endpoints);
+	char* stream_endpoint = zmsg_popstr(endpoints);
+	zmsg_destroy(&endpoints);
+
 	self->data = zsock_new(ZMQ_PAIR);
-	char* endpoint = zstr_recv(self->control);
 	int rc = zsock_connect(self->data, "%s", endpoint);
 	assert(rc != -1);
 	free(endpoint);
 
-	self->clients = zhash_new();
+	if (stream_endpoint != NULL) {
+		self->stream = zsock_new(ZMQ_PAIR);
+		zsock_set_sndhwm(self->stream, 0);
+		zsock_set_rcvhwm(self->stream, 0);
+		zsock_set_sndhwm(self->data, 0);
+		zsock_set_rcvhwm(self->data, 0);
+		rc = zsock_connect(self->stream, "%s", stream_endpoint);
+		assert(rc != -1);
+		free(stream_endpoint);
+	} else {
+		self->stream = zsock_new(ZMQ_STREAM);
+	}
+
+	self->clients = zwstable_new();
+	self->sending = zlist_new();
+	self->held = zwstable_new();
+	self->deliveries = zlist_new();
+	self->arena = zwsarena_new(DEFAULT_BUFFER_POOL_SIZE);
+	self->zlib = zwszlib_new(ZLIB_IDLE_CONTEXTS, DEFAULT_ZLIB_POOL_SIZE);
+	self->deflate_cache = zwscache_new(DEFAULT_DEFLATE_CACHE_SIZE);
+	self->options = zmsg_new();
+	self->subscriptions = zwstrie_new();
+	self->publish_count = 0;
+	self->max_message_size = DEFAULT_MAX_MESSAGE_SIZE;
+	self->fragment_streaming = false;
+	self->fragment_size = 0;
+	self->binary_routing_id = false;
+	self->batch_size = DEFAULT_BATCH_SIZE;
+	self->deflate.enabled = true;
+	self->deflate.server_max_window_bits = DEFAULT_SERVER_MAX_WINDOW_BITS;
+	self->deflate.client_max_window_bits = 15;
+	self->deflate_mem_level = 8;
+	self->outbound_queue_bytes = DEFAULT_OUTBOUND_QUEUE_BYTES;
+	self->outbound_queue_messages = 0;
+	self->slow_client_policy = ZWSSOCK_DROP_NEWEST;
 	return self;
 }
 
@@ -132,7 +577,26 @@ static void s_agent_destroy(agent_t** self_p) {
 	assert(self_p);
 	if (*self_p) {
 		agent_t* self = *self_p;
-		zhash_destroy(&self->clients);
+		for (size_t i = 0; i < self->worker_count; i++) {
+			zactor_destroy(&self->workers[i]);
+			zsock_destroy(&self->worker_streams[i]);
+			zsock_destroy(&self->worker_data[i]);
+		}
+		free(self->workers);
+		free(self->worker_streams);
+		free(self->worker_data);
+		zmsg_destroy(&self->broadcast_failed);
+		zmsg_destroy(&self->options);
+		s_agent_stop_compressors(self);
+		s_agent_destroy_clients(self);
+		zwszlib_destroy(&self->zlib);
+		zwscache_destroy(&self->deflate_cache);
+		zlist_destroy(&self->sending);
+		s_agent_destroy_held(self);
+		s_agent_destroy_deliveries(self);
+		zwsarena_destroy(&self->arena);
+		free(self->deflate_buffer);
+		zwstrie_destroy(&self->subscriptions);
 		zsock_destroy(&self->stream);
 		zsock_destroy(&self->data);
 		free(self);
@@ -140,6 +604,14 @@ static void s_agent_destroy(agent_t** self_p) {
 	}
 }
 
+/**
+ * Message to the application, waiting for room on the data socket
+*/
+typedef struct {
+	zmq_msg_t* parts;           //  Hash key (or routing ID), then the message frames
+	size_t count;
+} delivery_t;
+
 /**
  * Client connection state
 */
@@ -149,6 +621,18 @@ typedef enum {
 	CONNECTION_EXCEPTION = 2
 } connection_state_t;
 
+/**
+ * Outbound message, possibly queued to be sent in fragments
+*/
+typedef struct {
+	zframe_t* frame;            //  Uncompressed payload, sent after the JSMQ flag byte
+	byte* buffer;               //  Allocation holding `data`
+	byte* data;                 //  Compressed payload, if `frame` is NULL
+	size_t length;              //  Payload length, including the flag byte of an uncompressed payload
+	size_t offset;              //  Payload bytes already sent
+	byte flag;                  //  JSMQ "more" flag byte
+} outbound_t;
+
 /**
  * Client information
 */
@@ -158,42 +642,211 @@ typedef struct {
 	zframe_t* address;          //  Client address identity
 	char* hashkey;              //  Client hash key
 	zwsdecoder_t* decoder;
-	unsigned char client_compression_factor; // Requested compression factor by the server for the client
-	unsigned char server_compression_factor; // Requested compression factor by the client for the server
-	z_stream permessage_deflate_client;   // The client advertised permessage-deflate extension
-	z_stream permessage_deflate_server;   // The server advertised permessage-deflate extension
-
-	zmsg_t* outgoing_msg;		// Currently outgoing message, if not NULL final frame was not yet arrived
+	unsigned char client_compression_factor; // Window bits of the client's deflater, 0 without permessage-deflate
+	unsigned char server_compression_factor; // Window bits of the server's deflater, 0 without permessage-deflate
+	bool client_no_context_takeover;      // The client deflates each message on its own
+	bool server_no_context_takeover;      // Each message is deflated on its own
+	z_stream* inflater;                   // Inflates the client's messages; without context takeover, lent for each message
+	z_stream* deflater;                   // Deflates the messages to the client; without context takeover, lent for each message
+	bool deflate_reset_pending;           // A broadcast was sent deflated with a fresh context since the last message
+	uint32_t deflate_ratio;               // Running estimate of compressed / original size, in 1/1024ths
+	uint32_t deflate_skipped;             // Messages sent uncompressed for not shrinking
+	uint32_t inflate_ratio;               // Running estimate of inflated / compressed size, in 1/16ths
+
+	zmq_msg_t* outgoing_parts;	// Frames of the currently outgoing message, sent once its final frame has arrived
+	size_t outgoing_count;
+	size_t outgoing_capacity;
+	size_t message_first_part;	// First frame of the WebSocket message being received
+	bool message_flag_pending;	// The JSMQ "more" flag of that WebSocket message is yet to be read
+	bool message_continued;		// More WebSocket messages follow for the outgoing message
+
+	zlist_t* outbound;			// Messages queued to be sent in fragments, or until the client reads, oldest first
+	size_t queued_bytes;		// Payload bytes of the queued messages
+	bool sending_continued;		// The last message sent has more frames (JSMQ), the queue starts within one
+	bool blocked;				// The agent holds messages the stream socket refused (worker)
+	bool close_pending;			// Closed for being slow, waiting for the stream socket to take the close
+
+	zlist_t* subscriptions;		// Prefixes subscribed to (publisher), as frames
+	uint64_t published;			// Last message published to the client, see agent_t.publish_count
+
+	size_t inflate_pending;		// Messages being inflated by a compression thread
+	size_t deflate_pending;		// Messages being deflated by a compression thread
+	bool destroy_pending;		// Disconnected, destroyed once the compression thread is done with it
 } client_t;
 
+/**
+ * A message being broadcast, encoded at most once per compression window size
+*/
+typedef struct {
+	zmsg_t* msg;                // Frames of the message
+	size_t largest_frame;
+	size_t payload_length;      // Frames and their flag bytes
+	zmq_msg_t encoded[16];      // Encoded message by window bits, 0 for uncompressed
+	size_t encoded_length[16];  // Payload bytes of the encoded message
+	bool encoded_ready[16];
+} broadcast_t;
+
 /**
  * Create new client
 */
-static client_t* zwssock_client_new(agent_t* agent, zframe_t* address) {
+static client_t* zwssock_client_new(agent_t* agent, const byte* address, size_t size) {
 	client_t* self = (client_t *)zmalloc(sizeof(client_t));
 	assert(self);
-	ZWS_LOG_DEBUG(("Creating new client for socket [%s] (%s)\n", zframe_strhex(address), zsock_endpoint(agent->stream)));
 	self->agent = agent;
-	self->address = zframe_dup(address);
-	self->hashkey = zframe_strhex(address);
+	self->address = zframe_new(address, size);
+	self->hashkey = zframe_strhex(self->address);
+	ZWS_LOG_DEBUG(("Creating new client for socket [%s] (%s)\n", self->hashkey, zsock_endpoint(agent->stream)));
 	self->state = CONNECTION_CLOSED;
 	self->decoder = NULL;
-	self->client_compression_factor = 10;
-	self->server_compression_factor = 10;
-	self->permessage_deflate_client.zalloc   = Z_NULL;
-	self->permessage_deflate_client.zfree    = Z_NULL;
-	self->permessage_deflate_client.opaque   = Z_NULL;
-	self->permessage_deflate_client.avail_in = 0;
-	self->permessage_deflate_client.next_in  = Z_NULL;
-	self->permessage_deflate_server.zalloc   = Z_NULL;
-	self->permessage_deflate_server.zfree    = Z_NULL;
-	self->permessage_deflate_server.opaque   = Z_NULL;
-	self->permessage_deflate_server.avail_in = 0;
-	self->permessage_deflate_server.next_in  = Z_NULL;
-	self->outgoing_msg = NULL;
+	self->client_compression_factor = 0;
+	self->server_compression_factor = 0;
+	self->client_no_context_takeover = false;
+	self->server_no_context_takeover = false;
+	self->inflater = NULL;
+	self->deflater = NULL;
+	self->deflate_reset_pending = false;
+	self->deflate_ratio = 0;
+	self->deflate_skipped = 0;
+	self->inflate_ratio = INFLATE_INITIAL_RATIO;
+	self->outgoing_parts = NULL;
+	self->outgoing_count = 0;
+	self->outgoing_capacity = 0;
+	self->message_first_part = 0;
+	self->message_flag_pending = false;
+	self->message_continued = false;
+	self->outbound = zlist_new();
+	self->queued_bytes = 0;
+	self->sending_continued = false;
+	self->blocked = false;
+	self->close_pending = false;
+	self->subscriptions = zlist_new();
+	self->published = 0;
+	self->inflate_pending = 0;
+	self->deflate_pending = 0;
+	self->destroy_pending = false;
 	return self;
 }
 
+/**
+ * Get the next free frame of the outgoing message, growing the frame array if needed
+*/
+static zmq_msg_t* zwssock_client_next_part(client_t* self) {
+	if (self->outgoing_count == self->outgoing_capacity) {
+		self->outgoing_capacity = self->outgoing_capacity ? self->outgoing_capacity * 2 : 4;
+		self->outgoing_parts = (zmq_msg_t *)realloc(self->outgoing_parts, self->outgoing_capacity * sizeof(zmq_msg_t));
+		assert(self->outgoing_parts);
+	}
+	return &self->outgoing_parts[self->outgoing_count++];
+}
+
+/**
+ * Append a copy of `data` to the outgoing message
+*/
+static void zwssock_client_add_part(client_t* self, const byte* data, size_t size) {
+	zmq_msg_t* part = zwssock_client_next_part(self);
+	zmq_msg_init_size(part, size);
+	if (size > 0) {
+		memcpy(zmq_msg_data(part), data, size);
+	}
+}
+
+/**
+ * Send the outgoing message to the application, led by the client ID
+*/
+static void zwssock_client_send_parts(client_t* self) {
+	agent_t* agent = self->agent;
+	void* handle = zsock_resolve(agent->data);
+
+	zmq_msg_t key;
+	const void* key_data = agent->binary_routing_id ? (const void *)zframe_data(self->address) : (const void *)self->hashkey;
+	size_t key_size = agent->binary_routing_id ? zframe_size(self->address) : strlen(self->hashkey);
+	zmq_msg_init_size(&key, key_size);
+	memcpy(zmq_msg_data(&key), key_data, key_size);
+
+	// While the application is behind, the message waits in order rather than blocking the agent
+	if (zlist_size(agent->deliveries) > 0 || zmq_msg_send(&key, handle, ZMQ_SNDMORE | ZMQ_DONTWAIT) == -1) {
+		delivery_t* delivery = (delivery_t *)zmalloc(sizeof(delivery_t));
+		delivery->count = self->outgoing_count + 1;
+		delivery->parts = (zmq_msg_t *)malloc(delivery->count * sizeof(zmq_msg_t));
+		assert(delivery->parts);
+		zmq_msg_init(&delivery->parts[0]);
+		zmq_msg_move(&delivery->parts[0], &key);
+		for (size_t i = 0; i < self->outgoing_count; i++) {
+			zmq_msg_init(&delivery->parts[i + 1]);
+			zmq_msg_move(&delivery->parts[i + 1], &self->outgoing_parts[i]);
+		}
+		zmq_msg_close(&key);
+		zlist_append(agent->deliveries, delivery);
+		self->outgoing_count = 0;
+		return;
+	}
+	zmq_msg_close(&key);
+
+	// Once the first frame is taken, so is the rest of the message
+	for (size_t i = 0; i < self->outgoing_count; i++) {
+		if (zmq_msg_send(&self->outgoing_parts[i], handle, i + 1 < self->outgoing_count ? ZMQ_SNDMORE : 0) == -1) {
+			zmq_msg_close(&self->outgoing_parts[i]);
+		}
+	}
+	self->outgoing_count = 0;
+}
+
+/**
+ * Drop a partially received outgoing message
+*/
+static void zwssock_client_discard_parts(client_t* self) {
+	for (size_t i = 0; i < self->outgoing_count; i++) {
+		zmq_msg_close(&self->outgoing_parts[i]);
+	}
+	self->outgoing_count = 0;
+}
+
+/**
+ * Apply the subscribe (1) or unsubscribe (0) request making up the outgoing message, on a publisher
+*/
+static void zwssock_client_subscribe(client_t* self) {
+	size_t size = 0;
+	for (size_t i = 0; i < self->outgoing_count; i++) {
+		size += zmq_msg_size(&self->outgoing_parts[i]);
+	}
+
+	// The request, with the fragments it arrived in put back together
+	zframe_t* request = zframe_new(NULL, size);
+	byte* data = zframe_data(request);
+	for (size_t i = 0; i < self->outgoing_count; i++) {
+		memcpy(data, zmq_msg_data(&self->outgoing_parts[i]), zmq_msg_size(&self->outgoing_parts[i]));
+		data += zmq_msg_size(&self->outgoing_parts[i]);
+	}
+	zwssock_client_discard_parts(self);
+
+	data = zframe_data(request);
+	if (size > 0 && data[0] == 1) {
+		zwstrie_insert(self->agent->subscriptions, data + 1, size - 1, self);
+		zlist_append(self->subscriptions, zframe_new(data + 1, size - 1));
+
+	} else if (size > 0 && data[0] == 0) {
+		if (zwstrie_remove(self->agent->subscriptions, data + 1, size - 1, self)) {
+			for (zframe_t* prefix = (zframe_t *)zlist_first(self->subscriptions); prefix != NULL; prefix = (zframe_t *)zlist_next(self->subscriptions)) {
+				if (zframe_size(prefix) == size - 1 && memcmp(zframe_data(prefix), data + 1, size - 1) == 0) {
+					zlist_remove(self->subscriptions, prefix);
+					zframe_destroy(&prefix);
+					break;
+				}
+			}
+		}
+	}
+	zframe_destroy(&request);
+}
+
+/**
+ * Release the payload of an outbound message
+*/
+static void s_outbound_clear(outbound_t* self) {
+	zframe_destroy(&self->frame);
+	free(self->buffer);
+	self->buffer = NULL;
+}
+
 /**
  * Destroy client
 */
@@ -201,6 +854,14 @@ static void zwssock_client_destroy(client_t** self_p) {
 	assert(self_p);
 	if (*self_p) {
 		client_t* self = *self_p;
+		*self_p = NULL;
+
+		// A compression thread still uses the client's zlib contexts
+		if (self->inflate_pending > 0 || self->deflate_pending > 0) {
+			self->state = CONNECTION_EXCEPTION;
+			self->destroy_pending = true;
+			return;
+		}
 		ZWS_LOG_DEBUG(("Destroying client [%s]\n", self->hashkey));
 	
 		zframe_destroy(&self->address);
@@ -209,124 +870,278 @@ static void zwssock_client_destroy(client_t** self_p) {
 			zwsdecoder_destroy(&self->decoder);
 		}
 
-		if (self->client_compression_factor > 0) {
-			inflateEnd(&self->permessage_deflate_client);
-		}
+		zwszlib_release(self->agent->zlib, &self->inflater);
+		zwszlib_release(self->agent->zlib, &self->deflater);
+
+		zwssock_client_discard_parts(self);
+		free(self->outgoing_parts);
 
-		if (self->server_compression_factor > 0) {
-			deflateEnd(&self->permessage_deflate_server);
+		if (zlist_size(self->outbound) > 0) {
+			zlist_remove(self->agent->sending, self);
+			self->agent->stats.outbound_queued_messages -= zlist_size(self->outbound);
+			self->agent->stats.outbound_queued_bytes -= self->queued_bytes;
 		}
+		outbound_t* outbound;
+		while ((outbound = (outbound_t *)zlist_pop(self->outbound)) != NULL) {
+			s_outbound_clear(outbound);
+			free(outbound);
+		}
+		zlist_destroy(&self->outbound);
 
-		if (self->outgoing_msg != NULL) {
-			zmsg_destroy(&self->outgoing_msg);
+		zframe_t* prefix;
+		while ((prefix = (zframe_t *)zlist_pop(self->subscriptions)) != NULL) {
+			zwstrie_remove(self->agent->subscriptions, zframe_data(prefix), zframe_size(prefix), self);
+			zframe_destroy(&prefix);
 		}
+		zlist_destroy(&self->subscriptions);
 
 		free(self->hashkey);
 		free(self);
-		*self_p = NULL;
 	}
 }
 
-#define CHUNK 8192
+#define ZEROCOPY_THRESHOLD 256  // Smaller payloads are cheaper to copy than to share
 
 /**
- * Parse messages received from client, send them as ZMessages to the Server
+ * Consume the JSMQ flag, the first byte of every WebSocket message, telling whether more frames follow
+*/
+static void zwssock_client_read_flag(client_t* self, byte** data, size_t* size) {
+	if (self->message_flag_pending && *size > 0) {
+		self->message_flag_pending = false;
+		self->message_continued = ((*data)[0] == 1);
+		(*data)++;
+		(*size)--;
+	}
+}
+
+/**
+ * Append received data to the outgoing message
  *
- * A single request from the JSMQ client is comprised of multiple messages, one for each frame.
- * Each message must be decompressed if the client supplied a decompression factor during handshake.
- * A final request is constructed from the parsed (and inflated) messages, and sent to the server.
+ * Data of a WebSocket message arriving in several pieces (fragments) is added as several frames.
 */
-void zwssock_router_message_received(void* tag, byte* payload, int length) {
-	client_t* self = (client_t *)tag;
-	bool message_continued;
+static void zwssock_client_add_data(client_t* self, byte* data, size_t size, zwsdecoder_buffer_t* buffer) {
+	zwssock_client_read_flag(self, &data, &size);
 
-	// Create outgoing message (to ZMQ); lead with client ID
-	if (self->outgoing_msg == NULL) {
-		self->outgoing_msg = zmsg_new();
-		zmsg_addstr(self->outgoing_msg, self->hashkey);
+	if (size == 0) {
+		return;
 	}
 
-	// Decompress client data, if compressed
-	if (self->client_compression_factor > 0) {
-		uint8_t* outgoing_data = (uint8_t*)zmalloc(length + 4);
-		bool message_continued_parsed = false;
-
-		/* 7.2.2.  Decompression */
-		memcpy(outgoing_data, payload, length);
-		outgoing_data[length + 0] = 0x00;
-		outgoing_data[length + 1] = 0x00;
-		outgoing_data[length + 2] = 0xff;
-		outgoing_data[length + 3] = 0xff;
-
-		self->permessage_deflate_client.avail_in = length + 4;
-		self->permessage_deflate_client.next_in = outgoing_data;
-
-		// Inflate data
-		do {
-			uint8_t inflated_data[CHUNK] = {0};
-			self->permessage_deflate_client.avail_out = CHUNK;
-			self->permessage_deflate_client.next_out = inflated_data;
-
-			int rc = inflate(&self->permessage_deflate_client, Z_NO_FLUSH);
-			assert(rc != Z_STREAM_ERROR);
-
-			switch (rc) {
-				case Z_NEED_DICT:
-					rc = Z_DATA_ERROR;
-					break;
-				case Z_DATA_ERROR:
-				case Z_MEM_ERROR: {
-					inflateEnd(&self->permessage_deflate_client);
-					zmsg_destroy(&self->outgoing_msg);
+	if (buffer != NULL && size >= ZEROCOPY_THRESHOLD) {
+		// Reference the decoder's buffer instead of copying the payload
+		zwsdecoder_buffer_retain(buffer);
+		zmq_msg_init_data(zwssock_client_next_part(self), data, size, zwsdecoder_buffer_release, buffer);
+	} else {
+		zwssock_client_add_part(self, data, size);
+	}
+}
 
-					/* Close the client connection */
-					self->state = CONNECTION_EXCEPTION;
-					zframe_t* address = zframe_dup(self->address);
-					zframe_send(&address, self->agent->stream, ZFRAME_MORE);
-					zframe_t* empty = zframe_new_empty();
-					zframe_send(&empty, self->agent->stream, 0);
-					return;
-				}
-				default:
-					break;
-			}
+static void zwssock_free_buffer(void* data, void* hint) {
+	free(hint);
+}
 
-			// Add inflated data to message
-			unsigned int length_inflated = CHUNK - self->permessage_deflate_client.avail_out;
-			if (!message_continued_parsed) {
-				message_continued_parsed = true;
-				message_continued = (inflated_data[0] == 1);
-				zmsg_addmem(self->outgoing_msg, &inflated_data[1], length_inflated - 1);
-			} else {
-				zmsg_addmem(self->outgoing_msg, inflated_data, length_inflated);
-			}
-;
-		} while (self->permessage_deflate_client.avail_out == 0);
+/**
+ * Append a heap buffer of inflated data to the outgoing message as one frame, taking ownership of it
+*/
+static void zwssock_client_add_buffer(client_t* self, byte* buffer, size_t size) {
+	byte* data = buffer;
+	zwssock_client_read_flag(self, &data, &size);
+
+	if (size >= ZEROCOPY_THRESHOLD) {
+		zmq_msg_init_data(zwssock_client_next_part(self), data, size, zwssock_free_buffer, buffer);
+	} else {
+		if (size > 0) {
+			zwssock_client_add_part(self, data, size);
+		}
+		free(buffer);
+	}
+}
+
+/**
+ * Size to expect a compressed payload of `length` bytes to inflate to
+*/
+static size_t zwssock_client_inflate_hint(client_t* self, size_t length) {
+	return length < SIZE_MAX / self->inflate_ratio ? length * self->inflate_ratio / 16 + 64 : length;
+}
+
+/**
+ * Update the client's expansion ratio estimate with a payload inflated from `length` to `inflated` bytes
+*/
+static void zwssock_client_inflated(client_t* self, size_t length, size_t inflated) {
+	uint64_t sample = length > 0 ? (uint64_t)inflated * 16 / length : 16;
+	sample = sample < 16 * 1024 ? sample : 16 * 1024;
+	self->inflate_ratio = (uint32_t)((self->inflate_ratio * 7 + sample + 7) / 8);
+}
+
+/**
+ * The client's inflater, borrowed from the agent's pool if the client keeps no context; NULL on failure
+*/
+static z_stream* zwssock_client_inflater(client_t* self) {
+	if (self->inflater == NULL) {
+		// zlib deflates a raw stream with an 8 bit window as a 9 bit one, a larger window inflates it just as well
+		self->inflater = zwszlib_inflater(self->agent->zlib, self->client_compression_factor < 9 ? 9 : self->client_compression_factor);
+	}
+	return self->inflater;
+}
+
+/**
+ * The client's deflater, borrowed from the agent's pool if the client keeps no context; NULL on failure
+*/
+static z_stream* zwssock_client_deflater(client_t* self) {
+	if (self->deflater == NULL) {
+		self->deflater = zwszlib_deflater(self->agent->zlib, self->server_compression_factor, self->agent->deflate_mem_level);
+	}
+	return self->deflater;
+}
+
+/**
+ * Give the contexts borrowed for messages back to the pool, once no message is using them
+*/
+static void zwssock_client_release_contexts(client_t* self) {
+	if (self->client_no_context_takeover && self->inflate_pending == 0) {
+		zwszlib_release(self->agent->zlib, &self->inflater);
+	}
+	if (self->server_no_context_takeover && self->deflate_pending == 0) {
+		zwszlib_release(self->agent->zlib, &self->deflater);
+	}
+}
+
+/**
+ * Inflate a compressed payload (or fragment of one) into one frame of the outgoing message
+ *
+ * Returns false if the data could not be inflated.
+*/
+static bool zwssock_client_inflate(client_t* self, byte* data, size_t length, bool final) {
+	z_stream* stream = zwssock_client_inflater(self);
+	if (stream == NULL) {
+		return false;
+	}
+
+	size_t inflated_length;
+	byte* inflated = zwsdecoder_inflate(stream, data, length, final, zwssock_client_inflate_hint(self, length), &inflated_length);
+	if (inflated == NULL) {
+		return false;
+	}
+
+	if (final) {
+		zwssock_client_release_contexts(self);
+	}
+
+	zwssock_client_inflated(self, length, inflated_length);
+	zwssock_client_add_buffer(self, inflated, inflated_length);
+	return true;
+}
+
+/**
+ * Close the client's connection; while the stream socket refuses it, the agent holds the close
+*/
+static void zwssock_client_close(client_t* self) {
+	zmsg_t* close = zmsg_new();
+	zmsg_addmem(close, zframe_data(self->address), zframe_size(self->address));
+	zmsg_addmem(close, NULL, 0);
+	s_agent_send_stream(self->agent, &close);
+}
+
+/**
+ * Drop the message being received and close the connection of a client that sent data that could not be inflated
+*/
+static void zwssock_client_inflate_failed(client_t* self) {
+	// Compression threads may still be inflating later messages, the context is then released with the client
+	if (self->inflate_pending == 0) {
+		zwszlib_release(self->agent->zlib, &self->inflater);
+		self->client_compression_factor = 0;
+	}
+	zwssock_client_discard_parts(self);
+
+	/* Close the client connection */
+	self->state = CONNECTION_EXCEPTION;
+	zwssock_client_close(self);
+}
+
+/**
+ * Finish a received WebSocket message, sending the outgoing message to the server unless more follow
+*/
+static void zwssock_client_message_complete(client_t* self) {
+	// Empty frame
+	if (self->outgoing_count == self->message_first_part) {
+		zwssock_client_add_part(self, NULL, 0);
+	}
 
-		free(outgoing_data);
+	// If decompression / message construction is done, send the message to the server
+	if (!self->message_continued) {
+		if (self->agent->type == ZMQ_PUB) {
+			zwssock_client_subscribe(self);
+		} else {
+			zwssock_client_send_parts(self);
+		}
+	}
+}
+
+static bool s_agent_offload(agent_t* self, size_t pending, size_t length);
+static void s_agent_submit_inflate(agent_t* self, client_t* client, byte* payload, size_t length, bool compressed);
+
+/**
+ * Parse fragments received from client, send them as ZMessages to the Server
+ *
+ * A single request from the JSMQ client is comprised of multiple messages, one for each frame.
+ * Each message must be decompressed if the client supplied a decompression factor during handshake;
+ * fragments of a compressed message are inflated as they arrive.
+ * A final request is constructed from the parsed (and inflated) messages, and sent to the server.
+ * Uncompressed payloads the decoder holds in a shared buffer are passed on without a copy.
+*/
+void zwssock_router_fragment_received(void* tag, byte* payload, size_t length, zwsdecoder_buffer_t* buffer, bool first, bool final) {
+	client_t* self = (client_t *)tag;
+
+	// Remaining frames of a read that put the client in exception
+	if (self->state == CONNECTION_EXCEPTION) {
+		return;
+	}
+
+	// Clients may send any message uncompressed (RSV1 clear), which is passed on as it is
+	bool compressed = self->client_compression_factor > 0 && zwsdecoder_is_compressed(self->decoder);
+
+	// Large compressed messages are inflated by a compression thread, and the ones behind them, compressed
+	// or not, go the same way to keep them in order; streamed fragments are inflated as they arrive
+	if (!self->agent->fragment_streaming && (self->inflate_pending > 0 || (compressed && s_agent_offload(self->agent, 0, length)))) {
+		s_agent_submit_inflate(self->agent, self, payload, length, compressed);
+		return;
+	}
+
+	if (first) {
+		self->message_flag_pending = true;
+		self->message_continued = false;
+		self->message_first_part = self->outgoing_count;
+	}
+
+	// Decompress client data, if compressed
+	if (compressed) {
+		if (!zwssock_client_inflate(self, payload, length, final)) {
+			zwssock_client_inflate_failed(self);
+			return;
+		}
 
 	// No decompression needed
 	} else {
-		message_continued = (payload[0] == 1);
-		zmsg_addmem(self->outgoing_msg, &payload[1], length - 1);
+		zwssock_client_add_data(self, payload, length, buffer);
 	}
 
-	// If decompression / message construction is done, send the message to the server
-	if (!message_continued) {
-		zmsg_send(&self->outgoing_msg, self->agent->data);
+	if (final) {
+		zwssock_client_message_complete(self);
 	}
 }
 
+/**
+ * Parse a complete (possibly reassembled) message received from client
+*/
+void zwssock_router_message_received(void* tag, byte* payload, size_t length, zwsdecoder_buffer_t* buffer) {
+	zwssock_router_fragment_received(tag, payload, length, buffer, true, true);
+}
+
 /**
  * Send a websocket close frame
 */
 void send_empty_frame(void* tag) {
 	client_t* self = (client_t*)tag;
-	zframe_t* address = zframe_dup(self->address);
-	zframe_t* empty = zframe_new_empty();
-
-	zframe_send(&address, self->agent->stream, ZFRAME_MORE);
-	zframe_send(&empty, self->agent->stream, 0);
+	zwssock_client_close(self);
 }
 
 void websocket_close(void* tag) {
@@ -342,7 +1157,7 @@ void websocket_close(void* tag) {
 /**
  * Callback on WebSocket "close" frame received
 */
-void websocket_close_received(void* tag, byte* payload, int length) {
+void websocket_close_received(void* tag, byte* payload, size_t length) {
 	client_t* self = (client_t*)tag;
 	zframe_t* address = zframe_dup(self->address);
 
@@ -371,27 +1186,32 @@ void websocket_close_received(void* tag, byte* payload, int length) {
 /**
  * WebSocket "ping" frame received.
 */
-void ping_received(void* tag, byte* payload, int length) {
+void ping_received(void* tag, byte* payload, size_t length) {
 	ZWS_LOG_DEBUG(("Ping received\n"));
 
 	client_t* self = (client_t *)tag;
 
+	// A client that doesn't read its messages doesn't get pongs either
+	if (zlist_size(self->outbound) > 0 || self->blocked) {
+		return;
+	}
+
 	byte* pong = (byte*)zmalloc(2 + length);
 	pong[0] = 0x8A; // Pong and Final
 	pong[1] = (byte)(length & 127);
 	memcpy(pong + 2, payload, length);
 
-	zframe_t* address = zframe_dup(self->address);
-	zframe_send(&address, self->agent->stream, ZFRAME_MORE);
-	zframe_t* pongf = zframe_new(pong, length + 2);
-	zframe_send(&pongf, self->agent->stream, 0);
+	void* handle = zsock_resolve(self->agent->stream);
+	if (zmq_send(handle, zframe_data(self->address), zframe_size(self->address), ZMQ_SNDMORE | ZMQ_DONTWAIT) != -1) {
+		zmq_send(handle, pong, length + 2, ZMQ_DONTWAIT);
+	}
 	free(pong);
 }
 
 /**
  * WebSocket "pong" frame received.
 */
-void pong_received(void* tag, byte* payload, int length) {
+void pong_received(void* tag, byte* payload, size_t length) {
 	// TOOD: implement pong
 	ZWS_LOG_DEBUG(("Pong received\n"));
 }
@@ -430,8 +1250,14 @@ static void client_data_read(client_t* self) {
 			handshake = zwshandshake_new();
 			if (zwshandshake_parse_request(handshake, data)) {
 				// request is valid, getting the response
-				zframe_t* response = zwshandshake_get_response(handshake, &self->client_compression_factor, &self->server_compression_factor);
+				zwshandshake_deflate_t deflate;
+				zframe_t* response = zwshandshake_get_response(handshake, &self->agent->deflate, &deflate);
 				if (response) {
+					self->client_compression_factor = deflate.enabled ? deflate.client_max_window_bits : 0;
+					self->server_compression_factor = deflate.enabled ? deflate.server_max_window_bits : 0;
+					self->client_no_context_takeover = deflate.client_no_context_takeover;
+					self->server_no_context_takeover = deflate.server_no_context_takeover;
+
 					zframe_t* address = zframe_dup(self->address);
 
 					zframe_send(&address, self->agent->stream, ZFRAME_MORE);
@@ -439,19 +1265,18 @@ static void client_data_read(client_t* self) {
 
 					free(response);
 
-					if (self->client_compression_factor > 0) {
-						int ret = inflateInit2(&self->permessage_deflate_client, -self->client_compression_factor);
-						if (ret != Z_OK) {
-							ZWS_LOG_DEBUG(("EXCEPTION: Could not inflate - RC: %i\n", ret));
+					// Contexts kept between messages are held for the life of the client, the others are borrowed for each message
+					if (self->client_compression_factor > 0 && !self->client_no_context_takeover) {
+						if (zwssock_client_inflater(self) == NULL) {
+							ZWS_LOG_DEBUG(("EXCEPTION: Could not inflate\n"));
 							self->client_compression_factor = 0;
 							self->state = CONNECTION_EXCEPTION;
 							not_acceptable(self->address, self->agent->stream);
 						}
 					}
-					if (self->server_compression_factor > 0) {
-						int ret = deflateInit2(&self->permessage_deflate_server, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -self->server_compression_factor, 8, Z_DEFAULT_STRATEGY);
-						if (ret != Z_OK) {
-							ZWS_LOG_DEBUG(("EXCEPTION: Could not deflate - RC: %i\n", ret));
+					if (self->server_compression_factor > 0 && !self->server_no_context_takeover) {
+						if (zwssock_client_deflater(self) == NULL) {
+							ZWS_LOG_DEBUG(("EXCEPTION: Could not deflate\n"));
 							self->server_compression_factor = 0;
 							self->state = CONNECTION_EXCEPTION;
 							not_acceptable(self->address, self->agent->stream);
@@ -459,6 +1284,12 @@ static void client_data_read(client_t* self) {
 					}
 
 					self->decoder = zwsdecoder_new(self, &zwssock_router_message_received, &websocket_close_received, &ping_received, &pong_received);
+					zwsdecoder_set_max_message_size(self->decoder, self->agent->max_message_size);
+					zwsdecoder_set_arena(self->decoder, self->agent->arena);
+					zwsdecoder_set_permessage_deflate(self->decoder, self->client_compression_factor > 0);
+					if (self->agent->fragment_streaming) {
+						zwsdecoder_set_fragment_callback(self->decoder, &zwssock_router_fragment_received);
+					}
 					ZWS_LOG_DEBUG((" - Handshake successful -- client connected\n"));
 					self->state = CONNECTION_CONNECTED;
 
@@ -482,10 +1313,11 @@ static void client_data_read(client_t* self) {
 				self->state = CONNECTION_EXCEPTION;
 				break;
 			}
-			zwsdecoder_process_buffer(self->decoder, data);
+			zwsdecoder_process_buffer(self->decoder, &data);
 
 			if (zwsdecoder_is_errored(self->decoder)) {
 				ZWS_LOG_DEBUG(("EXCEPTION: Decoder encountered an error\n"));
+				send_empty_frame(self);
 				self->state = CONNECTION_EXCEPTION;
 			}
 			break;
@@ -500,17 +1332,90 @@ static void client_data_read(client_t* self) {
 }
 
 /**
- * Callback executed when client removed from client hash table
+ * Destroy the clients and their table
 */
-static void client_free(void* argument) {
-	client_t* client = (client_t *)argument;
-	zwssock_client_destroy(&client);
+static void s_agent_destroy_clients(agent_t* self) {
+	for (client_t* client = (client_t *)zwstable_first(self->clients); client != NULL; client = (client_t *)zwstable_next(self->clients)) {
+		zwssock_client_destroy(&client);
+	}
+	zwstable_destroy(&self->clients);
+}
+
+static void s_agent_start_workers(agent_t* self, size_t count);
+static size_t s_agent_shard(agent_t* self, const byte* address, size_t size);
+static bool s_agent_application_ready(agent_t* self);
+static void s_agent_wait_worker(agent_t* self, size_t index);
+static void s_agent_start_compressors(agent_t* self, size_t count);
+static void s_agent_add_worker_stats(agent_t* self, size_t index, zwssock_stats_t* stats);
+static void s_agent_add_memory_stats(agent_t* self, zwssock_stats_t* stats);
+
+/**
+ * Apply an option sent by s_set_option, on the workers too
+*/
+static void s_agent_set_option(agent_t* self, const char* name, unsigned long long value) {
+	if (streq(name, "workers")) {
+		if (value > 0 && self->worker_count == 0 && zwstable_size(self->clients) == 0) {
+			s_agent_start_workers(self, (size_t)value);
+		}
+		return;
+	}
+
+	char value_str[32];
+	snprintf(value_str, sizeof(value_str), "%llu", value);
+	zmsg_addstr(self->options, name);
+	zmsg_addstr(self->options, value_str);
+	for (size_t i = 0; i < self->worker_count; i++) {
+		zstr_sendx(self->workers[i], "SET", name, value_str, NULL);
+		s_agent_wait_worker(self, i);
+	}
+
+	if (streq(name, "max_message_size")) {
+		self->max_message_size = (size_t)value;
+	} else if (streq(name, "fragment_streaming")) {
+		self->fragment_streaming = value != 0;
+	} else if (streq(name, "fragment_size")) {
+		self->fragment_size = (size_t)value;
+	} else if (streq(name, "buffer_pool_size")) {
+		zwsarena_set_ceiling(self->arena, (size_t)value);
+	} else if (streq(name, "zlib_pool_size")) {
+		zwszlib_set_ceiling(self->zlib, (size_t)value);
+	} else if (streq(name, "deflate_cache_size")) {
+		zwscache_set_ceiling(self->deflate_cache, (size_t)value);
+	} else if (streq(name, "outbound_queue_bytes")) {
+		self->outbound_queue_bytes = (size_t)value;
+	} else if (streq(name, "outbound_queue_messages")) {
+		self->outbound_queue_messages = (size_t)value;
+	} else if (streq(name, "slow_client_policy")) {
+		self->slow_client_policy = value <= ZWSSOCK_DISCONNECT ? (zwssock_slow_client_policy_t)value : ZWSSOCK_DROP_NEWEST;
+	} else if (streq(name, "binary_routing_id")) {
+		self->binary_routing_id = value != 0;
+	} else if (streq(name, "batch_size")) {
+		self->batch_size = value > 0 ? (size_t)value : 1;
+	} else if (streq(name, "compression_threads")) {
+		s_agent_start_compressors(self, (size_t)value);
+	} else if (streq(name, "compression_threshold")) {
+		self->compression_threshold = (size_t)value;
+	} else if (streq(name, "compression_ratio")) {
+		self->compression_ratio = (uint32_t)((value < 200 ? value : 200) * 1024 / 100);
+	} else if (streq(name, "compression")) {
+		self->deflate.enabled = value != 0;
+	} else if (streq(name, "server_max_window_bits")) {
+		self->deflate.server_max_window_bits = (unsigned char)(value < 9 ? 9 : value > 15 ? 15 : value);
+	} else if (streq(name, "client_max_window_bits")) {
+		self->deflate.client_max_window_bits = (unsigned char)(value < 8 ? 8 : value > 15 ? 15 : value);
+	} else if (streq(name, "server_no_context_takeover")) {
+		self->deflate.server_no_context_takeover = value != 0;
+	} else if (streq(name, "client_no_context_takeover")) {
+		self->deflate.client_no_context_takeover = value != 0;
+	} else if (streq(name, "deflate_mem_level")) {
+		self->deflate_mem_level = (int)(value < 1 ? 1 : value > 9 ? 9 : value);
+	}
 }
 
 /**
  * Handle message from control socket
  *
- * Allows configuration of socket address, and termination.
+ * Allows configuration of socket address and options, and termination.
 */
 static int s_agent_handle_control(agent_t* self) {
 	//  Get the whole message off the control socket in one go
@@ -532,6 +1437,32 @@ static int s_agent_handle_control(agent_t* self) {
 		assert(rc != -1);
 		free(endpoint);
 	}
+	else if (streq(command, "SET")) {
+		char* name = zmsg_popstr(request);
+		char* value = zmsg_popstr(request);
+		s_agent_set_option(self, name, strtoull(value, NULL, 10));
+		free(name);
+		free(value);
+		zsock_signal(self->control, 0);
+	}
+	else if (streq(command, "STATS")) {
+		zwssock_stats_t stats = self->stats;
+		s_agent_add_memory_stats(self, &stats);
+		for (size_t i = 0; i < self->worker_count; i++) {
+			s_agent_add_worker_stats(self, i, &stats);
+		}
+		zframe_t* reply = zframe_new(&stats, sizeof(zwssock_stats_t));
+		zframe_send(&reply, self->control, 0);
+	}
+	else if (streq(command, "BLOCKED") || streq(command, "RESUMED")) {
+		// The agent holds messages to a client of the worker, or sent them all
+		zframe_t* address = zmsg_pop(request);
+		client_t* client = address != NULL ? (client_t *)zwstable_lookup(self->clients, zframe_data(address), zframe_size(address)) : NULL;
+		if (client != NULL) {
+			client->blocked = streq(command, "BLOCKED");
+		}
+		zframe_destroy(&address);
+	}
 	else if (streq(command, "$TERM")) {
 		return -1;
 	}
@@ -544,205 +1475,1759 @@ static int s_agent_handle_control(agent_t* self) {
  * Handle messages from the socket
 */
 static int s_agent_handle_router(agent_t* self) {
-	zframe_t* address = zframe_recv(self->stream);
-	char* hashkey = zframe_strhex(address);
-	client_t* client = zhash_lookup(self->clients, hashkey);
+	// Routing IDs are at most 255 bytes, read straight into the stack
+	byte address[256];
+	int size = zmq_recv(zsock_resolve(self->stream), address, sizeof(address), 0);
+	if (size == -1) {
+		return -1;
+	}
+	assert((size_t)size <= sizeof(address));
+
+	client_t* client = (client_t *)zwstable_lookup(self->clients, address, size);
 	if (client == NULL) {
-		client = zwssock_client_new(self, address);
+		client = zwssock_client_new(self, address, size);
 
-		zhash_insert(self->clients, hashkey, client);
-		zhash_freefn(self->clients, hashkey, client_free);
+		// The client's address frame holds the key
+		zwstable_insert(self->clients, zframe_data(client->address), zframe_size(client->address), client);
 	}
 
 	client_data_read(client);
 
 	//  If client is misbehaving, remove it
 	if (client->state == CONNECTION_EXCEPTION) {
-		zhash_delete(self->clients, client->hashkey);
+		zwstable_delete(self->clients, zframe_data(client->address), zframe_size(client->address));
+		zwssock_client_destroy(&client);
 	}
-	zframe_destroy(&address);
-	free(hashkey);
 
 	return 0;
 }
 
 /**
- * Compute the message header frame
+ * Get the routing ID from a hash key, its hex string, decoding it into `address` (256 bytes)
+ *
+ * In binary routing ID mode the hash key is the routing ID. Returns NULL for an invalid hash key.
 */
-static void compute_frame_header(byte header, int payload_length, int* frame_size, int* payload_start_index, byte* outgoing_data) {
-	*frame_size = 2 + payload_length;
-	*payload_start_index = 2;
+static const byte* s_agent_routing_id(agent_t* self, const byte* hashkey, size_t* size, byte* address) {
+	if (self->binary_routing_id) {
+		return hashkey;
+	}
 
-	if (payload_length > 125) {
-		*frame_size += 2;
-		*payload_start_index += 2;
+	const char* hex = (const char *)hashkey;
+	if (*size % 2 != 0 || *size / 2 > 256) {
+		return NULL;
+	}
+	*size /= 2;
 
-		if (payload_length > 0xFFFF) { // 2 bytes max value
-			*frame_size += 6;
-			*payload_start_index += 6;
+	for (size_t i = 0; i < *size * 2; i++) {
+		char c = hex[i];
+		int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'A' && c <= 'F' ? c - 'A' + 10 : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+		if (digit < 0) {
+			return NULL;
 		}
+		address[i / 2] = (byte)(i % 2 == 0 ? digit << 4 : address[i / 2] | digit);
 	}
+	return address;
+}
 
-	outgoing_data[0] = header;
-
-	// No mask
-	outgoing_data[1] = 0x00;
+/**
+ * Look up a client by hash key, without allocating
+*/
+static client_t* s_agent_lookup(agent_t* self, zframe_t* hashkey) {
+	byte buffer[256];
+	size_t size = zframe_size(hashkey);
+	const byte* address = s_agent_routing_id(self, zframe_data(hashkey), &size, buffer);
 
-	if (payload_length <= 125) {
-		outgoing_data[1] |= (byte)(payload_length & 127);
-	} else if (payload_length <= 0xFFFF) { // maximum size of short
-		outgoing_data[1] |= 126;
-		outgoing_data[2] = (payload_length >> 8) & 0xFF;
-		outgoing_data[3] = payload_length & 0xFF;
-	} else {
-		outgoing_data[1] |= 127;
-		outgoing_data[2] = 0;
-		outgoing_data[3] = 0;
-		outgoing_data[4] = 0;
-		outgoing_data[5] = 0;
-		outgoing_data[6] = (payload_length >> 24) & 0xFF;
-		outgoing_data[7] = (payload_length >> 16) & 0xFF;
-		outgoing_data[8] = (payload_length >> 8) & 0xFF;
-		outgoing_data[9] = payload_length & 0xFF;
-	}
+	return address != NULL ? (client_t *)zwstable_lookup(self->clients, address, size) : NULL;
 }
 
 /**
- * Handle outbound messages
+ * Send the next fragment of an outbound message, returning 1 once the whole message is sent, 0 if more
+ * fragments follow, -1 if the client isn't reading and the fragment has to wait
  *
- * Sends agent data to the designated client
+ * Fragments carry at most `fragment_size` payload bytes; 0 sends the rest of the message in one frame.
+ * A message to a client that is gone counts as sent, its disconnect destroys the client.
 */
-static int s_agent_handle_data(agent_t* self) {
-	// The first frame is client address (hashkey)
-	// If caller provides an unknown client address, the message is ignored.
-	// The assert disappears when we start to timeout clients...
-	zmsg_t* request = zmsg_recv(self->data);
-	char* hashkey = zmsg_popstr(request);
-	client_t* client = zhash_lookup(self->clients, hashkey);
-
-	// Unknown client
-	if (!client) {
-		free(hashkey);
-		zmsg_destroy(&request);
+static int s_outbound_send_fragment(client_t* client, outbound_t* self, size_t fragment_size) {
+	if (client->blocked) {
 		return -1;
 	}
 
-	zframe_t* address;
+	// The stream socket takes or refuses the routing ID, before the frame is built
+	void* handle = zsock_resolve(client->agent->stream);
+	if (zmq_send(handle, zframe_data(client->address), zframe_size(client->address), ZMQ_SNDMORE | ZMQ_DONTWAIT) == -1) {
+		if (errno == EAGAIN) {
+			return -1;
+		}
+		self->offset = self->length;
+		return 1;
+	}
 
-	// Each frame is a full ZMQ message with identity frame
-	while (zmsg_size(request)) {
-		zframe_t* received_frame = zmsg_pop(request);
-		bool message_continued = false;
+	size_t length = self->length - self->offset;
+	if (fragment_size > 0 && length > fragment_size) {
+		length = fragment_size;
+	}
 
-		if (zmsg_size(request))
-			message_continued = true;
+	bool first = self->offset == 0;
+	bool final = self->offset + length == self->length;
 
-		if (client->server_compression_factor > 0) {
-			byte byte_message_not_continued = 0;
-			byte byte_message_continued = 1;
+	// Final bit; binary opcode and, if compressed, RSV1 on the first frame; continuation opcode on the others
+	byte header = (final ? 0x80 : 0x00) | (first ? (self->frame == NULL ? 0x42 : 0x02) : 0x00);
 
-			int frame_size = zframe_size(received_frame);
+	byte header_data[10];
+	uint64_t frame_size;
+	int payload_start_index;
+	zwsencoder_compute_frame_header(header, length, &frame_size, &payload_start_index, header_data);
 
-			// This assumes that a compressed message is never longer than 64 bytes plus the original message. A better assumption without realloc would be great.
-			unsigned int available = frame_size + 64 + 10;
-			byte* compressed_payload = (byte*)zmalloc(available);
-			client->permessage_deflate_server.avail_in = 1;
-			client->permessage_deflate_server.next_in  = (message_continued ? &byte_message_continued : &byte_message_not_continued);
-			client->permessage_deflate_server.avail_out = available;
-			client->permessage_deflate_server.next_out = &compressed_payload[10];
+	// Build the frame in place, the payload is copied once
+	zframe_t* data = zframe_new(NULL, frame_size);
+	byte* outgoing_data = zframe_data(data);
+	memcpy(outgoing_data, header_data, payload_start_index);
+	outgoing_data += payload_start_index;
 
-			deflate(&client->permessage_deflate_server, Z_NO_FLUSH);
+	if (self->frame != NULL) {
+		size_t offset = self->offset;
+		size_t remaining = length;
 
-			client->permessage_deflate_server.avail_in = frame_size;
-			client->permessage_deflate_server.next_in  = zframe_data(received_frame);
+		// message_continued byte
+		if (offset == 0) {
+			*outgoing_data++ = self->flag;
+			offset++;
+			remaining--;
+		}
+		memcpy(outgoing_data, zframe_data(self->frame) + offset - 1, remaining);
+	} else {
+		memcpy(outgoing_data, self->data + self->offset, length);
+	}
+	self->offset += length;
 
-			deflate(&client->permessage_deflate_server, Z_SYNC_FLUSH);
-			assert(client->permessage_deflate_server.avail_in == 0);
+	// Once the routing ID is taken, so is the frame
+	if (zframe_send(&data, client->agent->stream, ZFRAME_DONTWAIT) == -1) {
+		zframe_destroy(&data);
+	}
 
-			int payload_length = available - client->permessage_deflate_server.avail_out;
-			payload_length -= 4; /* skip the 0x00 0x00 0xff 0xff */
+	if (final) {
+		client->sending_continued = self->flag != 0;
+	}
+	return final ? 1 : 0;
+}
 
-			byte initial_header[10];
-			int payload_start_index;
-			compute_frame_header((byte)0xC2, payload_length, &frame_size, &payload_start_index, initial_header); // 0xC2 = Final, RSV1, Binary
+/**
+ * Queue an outbound message behind the client's others, taking ownership of its payload
+ *
+ * A compressed payload without a `buffer` is borrowed, and copied.
+*/
+static void s_agent_enqueue(agent_t* self, client_t* client, outbound_t* outbound) {
+	outbound_t* queued = (outbound_t *)zmalloc(sizeof(outbound_t));
+	*queued = *outbound;
+	if (queued->frame == NULL && queued->buffer == NULL) {
+		queued->buffer = (byte *)malloc(queued->length);
+		assert(queued->buffer);
+		memcpy(queued->buffer, outbound->data, queued->length);
+		queued->data = queued->buffer;
+	}
+	if (zlist_size(client->outbound) == 0) {
+		zlist_append(self->sending, client);
+	}
+	zlist_append(client->outbound, queued);
 
-			// We reserved 10 extra bytes before the compressed message, here we prepend the header before it, prevents allocation of the message and a memcpy of the compressed content
-			byte* outgoing_data = &compressed_payload[10 - payload_start_index];
-			memcpy(outgoing_data, initial_header, payload_start_index);
+	client->queued_bytes += queued->length;
+	self->stats.outbound_queued_messages++;
+	self->stats.outbound_queued_bytes += queued->length;
+	if (client->queued_bytes > self->stats.outbound_queue_peak_bytes) {
+		self->stats.outbound_queue_peak_bytes = client->queued_bytes;
+	}
+}
 
-			address = zframe_dup(client->address);
+/**
+ * Take the oldest message off a client's queue, NULL if it's empty; the client stays in `sending`
+*/
+static outbound_t* s_agent_dequeue(agent_t* self, client_t* client) {
+	outbound_t* outbound = (outbound_t *)zlist_pop(client->outbound);
+	if (outbound != NULL) {
+		client->queued_bytes -= outbound->length;
+		self->stats.outbound_queued_messages--;
+		self->stats.outbound_queued_bytes -= outbound->length;
+	}
+	return outbound;
+}
 
-			zframe_send(&address, self->stream, ZFRAME_MORE);
+/**
+ * Whether a client's queue holding `messages` messages of `bytes` payload bytes is over the limits
+*/
+static bool s_agent_queue_exceeded(agent_t* self, size_t messages, size_t bytes) {
+	return (self->outbound_queue_messages > 0 && messages > self->outbound_queue_messages)
+		|| (self->outbound_queue_bytes > 0 && bytes > self->outbound_queue_bytes);
+}
 
-			zframe_t* data = zframe_new(outgoing_data, frame_size);
-			zframe_send(&data, self->stream, 0);
+/**
+ * Drop the queue of a client that reads too slowly and close its connection
+*/
+static void s_agent_disconnect_slow(agent_t* self, client_t* client) {
+	ZWS_LOG_DEBUG(("Disconnecting slow client [%s]\n", client->hashkey));
+
+	outbound_t* outbound;
+	while ((outbound = s_agent_dequeue(self, client)) != NULL) {
+		s_outbound_clear(outbound);
+		free(outbound);
+		self->stats.outbound_dropped_messages++;
+	}
+	zlist_remove(self->sending, client);
+	self->stats.slow_client_disconnects++;
 
-			free(compressed_payload);
-			zframe_destroy(&received_frame);
+	client->state = CONNECTION_EXCEPTION;
+	zwssock_client_close(client);
+}
 
-		} else {
-			int payload_length = zframe_size(received_frame) + 1;
-			byte* outgoing_data = (byte*)zmalloc(payload_length + 10); /* + 10 = max size of header */
+/**
+ * The queued message at `index`, NULL past the end; the message being sent is at 0
+*/
+static outbound_t* s_outbound_at(zlist_t* queue, size_t index) {
+	outbound_t* outbound = (outbound_t *)zlist_first(queue);
+	while (outbound != NULL && index-- > 0) {
+		outbound = (outbound_t *)zlist_next(queue);
+	}
+	return outbound;
+}
 
-			int frame_size, payload_start_index;
-			compute_frame_header(0x82, payload_length, &frame_size, &payload_start_index, outgoing_data); /* 0x82 = Binary and Final */
+/**
+ * Drop the oldest messages queued for a client until one of `parts` frames and `length` payload bytes
+ * fits, returning false if it still doesn't
+ *
+ * Messages are dropped whole, all their JSMQ frames: the one being sent is finished, and one whose
+ * last frames are still being deflated is kept.
+*/
+static bool s_agent_drop_oldest(agent_t* self, client_t* client, size_t parts, size_t length) {
+	zlist_t* queue = client->outbound;
+
+	// The message being sent, if its first frame, or the first fragment of it, is out
+	size_t kept = 0;
+	outbound_t* outbound = (outbound_t *)zlist_first(queue);
+	bool started = client->sending_continued || outbound->offset > 0;
+	while (started && outbound != NULL) {
+		kept++;
+		started = outbound->flag != 0;
+		outbound = (outbound_t *)zlist_next(queue);
+	}
 
-			// message_continued byte
-			outgoing_data[payload_start_index] = (byte)(message_continued ? 1 : 0);
-			payload_start_index++;
+	while (s_agent_queue_exceeded(self, zlist_size(queue) + parts, client->queued_bytes + length)) {
+		size_t count = 0;
+		bool complete = false;
+		for (outbound = s_outbound_at(queue, kept); outbound != NULL && !complete; outbound = (outbound_t *)zlist_next(queue)) {
+			count++;
+			complete = outbound->flag == 0;
+		}
+		if (!complete) {
+			break;
+		}
 
-			// payload
-			memcpy(outgoing_data + payload_start_index, zframe_data(received_frame), zframe_size(received_frame));
-			address = zframe_dup(client->address);
+		while (count-- > 0) {
+			outbound = s_outbound_at(queue, kept);
+			zlist_remove(queue, outbound);
+			client->queued_bytes -= outbound->length;
+			self->stats.outbound_queued_messages--;
+			self->stats.outbound_queued_bytes -= outbound->length;
+			self->stats.outbound_dropped_messages++;
+			s_outbound_clear(outbound);
+			free(outbound);
+		}
+	}
 
-			zframe_send(&address, self->stream, ZFRAME_MORE);
-			zframe_t* data = zframe_new(outgoing_data, frame_size);
-			zframe_send(&data, self->stream, 0);
+	if (zlist_size(queue) == 0) {
+		zlist_remove(self->sending, client);
+	}
+	return !s_agent_queue_exceeded(self, zlist_size(queue) + parts, client->queued_bytes + length);
+}
 
-			zframe_destroy(&received_frame);
-			free(outgoing_data);
-		}
-		// TODO: check return code, on return code different than 0 or again set CONNECTION_EXCEPTION
-	}  // End while
+/**
+ * Make room in a client's queue for a message of `parts` frames and `length` payload bytes, as the slow
+ * client policy says, returning false if the message is to be dropped
+ *
+ * The limits apply to a backlog: a client with nothing queued takes any message.
+*/
+static bool s_agent_admit(agent_t* self, client_t* client, size_t parts, size_t length) {
+	if (client->state == CONNECTION_EXCEPTION) {
+		return false;
+	}
+	if (zlist_size(client->outbound) == 0 || !s_agent_queue_exceeded(self, zlist_size(client->outbound) + parts, client->queued_bytes + length)) {
+		return true;
+	}
 
-	free(hashkey);
-	zmsg_destroy(&request);
-	return 0;
+	if (self->slow_client_policy == ZWSSOCK_DISCONNECT) {
+		s_agent_disconnect_slow(self, client);
+	} else if (self->slow_client_policy == ZWSSOCK_DROP_OLDEST && s_agent_drop_oldest(self, client, parts, length)) {
+		return true;
+	}
+	self->stats.outbound_dropped_messages += parts;
+	return false;
 }
 
-void s_agent_task(zsock_t* control, void* args) {
-	// Let the main thread continue
-	zsock_signal(control, 0);
+/**
+ * Send one fragment for each client with queued messages, so that large messages take turns
+ * with each other and with the rest of the traffic; returns whether any could be sent
+*/
+static bool s_agent_send_fragments(agent_t* self) {
+	size_t count = zlist_size(self->sending);
+	bool sent = false;
+
+	while (count-- > 0) {
+		client_t* client = (client_t *)zlist_pop(self->sending);
+		outbound_t* outbound = (outbound_t *)zlist_first(client->outbound);
+
+		int rc = s_outbound_send_fragment(client, outbound, self->fragment_size);
+		if (rc == 1) {
+			s_agent_dequeue(self, client);
+			s_outbound_clear(outbound);
+			free(outbound);
+		}
+		sent = sent || rc >= 0;
 
-	// Create agent instance as we start this task
-	agent_t* self = s_agent_new(control);
-	if (!self)                  //  Interrupted
+		if (zlist_size(client->outbound) > 0) {
+			zlist_append(self->sending, client);
+		}
+	}
+	return sent;
+}
+
+/**
+ * Send an outbound message to a client, or queue it, taking ownership of its payload
+ *
+ * A compressed payload without a `buffer` is borrowed, and copied if the message has to wait.
+*/
+static void s_agent_send_outbound(agent_t* self, client_t* client, outbound_t* outbound) {
+	// Disconnected for reading too slowly
+	if (client->state == CONNECTION_EXCEPTION) {
+		s_outbound_clear(outbound);
 		return;
+	}
 
-	zpoller_t* poller = zpoller_new(self->control, self->stream, self->data, NULL);
-	assert(poller);
+	// Send right away unless the message has to be fragmented, must wait its turn behind queued
+	// messages, or the stream socket refuses it
+	if (zlist_size(client->outbound) == 0 && (self->fragment_size == 0 || outbound->length <= self->fragment_size)
+			&& s_outbound_send_fragment(client, outbound, 0) == 1) {
+		s_outbound_clear(outbound);
+	} else {
+		s_agent_enqueue(self, client, outbound);
+	}
+}
 
-	void* which;
+/**
+ * The agent's deflate output buffer, grown to hold `size` bytes
+*/
+static byte* s_agent_deflate_buffer(agent_t* self, size_t size) {
+	if (size > self->deflate_buffer_size) {
+		free(self->deflate_buffer);
+		self->deflate_buffer = (byte *)malloc(size);
+		assert(self->deflate_buffer);
+		self->deflate_buffer_size = size;
+	}
+	return self->deflate_buffer;
+}
 
-	while ((which = zpoller_wait(poller, -1)) != NULL) {
-		if (zpoller_terminated(poller)) {
-			break;
+/**
+ * Release a deflate output buffer that an unusually large message grew, once that message is out of it
+*/
+static void s_agent_trim_deflate_buffer(agent_t* self) {
+	if (self->deflate_buffer_size > DEFLATE_BUFFER_KEPT) {
+		free(self->deflate_buffer);
+		self->deflate_buffer = NULL;
+		self->deflate_buffer_size = 0;
+	}
+}
 
-		} if (which == self->control) {
-			// Something went wrong
-			// TODO: use modern CZMQ patterns for handling control pipe
-			if (s_agent_handle_control(self) == -1) {
-				break;
-			}
-		} else if (which == self->stream) {
-			s_agent_handle_router(self);
+/**
+ * Whether to deflate a message of `length` bytes for a client that negotiated permessage-deflate
+ *
+ * Small messages go uncompressed, and so do the messages of a client whose messages stopped shrinking,
+ * but for one in DEFLATE_PROBE_INTERVAL that keeps its estimate current.
+*/
+static bool s_agent_should_deflate(agent_t* self, client_t* client, size_t length) {
+	if (length < self->compression_threshold) {
+		self->stats.deflate_skipped_small++;
+		self->stats.deflate_skipped_bytes += length;
+		return false;
+	}
 
-		} else if (which == self->data) {
-			s_agent_handle_data(self);
-		}
+	if (self->compression_ratio > 0 && client->deflate_ratio > self->compression_ratio
+			&& ++client->deflate_skipped % DEFLATE_PROBE_INTERVAL != 0) {
+		self->stats.deflate_skipped_ratio++;
+		self->stats.deflate_skipped_bytes += length;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Update a client's compression ratio estimate with a message deflated from `length` to `compressed` bytes
+*/
+static void zwssock_client_deflated(client_t* self, size_t length, size_t compressed) {
+	uint64_t sample = length > 0 ? (uint64_t)compressed * 1024 / length : 1024;
+	self->deflate_ratio = (uint32_t)((self->deflate_ratio * 7 + (sample < 2048 ? sample : 2048)) / 8);
+}
+
+/**
+ * Account for a message deflated from `length` to `compressed` bytes for a client
+*/
+static void s_agent_deflated(agent_t* self, client_t* client, size_t length, size_t compressed) {
+	if (client != NULL) {
+		zwssock_client_deflated(client, length, compressed);
+	}
+	self->stats.deflated_messages++;
+	self->stats.deflate_bytes_in += length;
+	self->stats.deflate_bytes_out += compressed;
+}
+
+/**
+ * A message handed to a compression thread
+*/
+typedef struct {
+	client_t* client;
+	bool inflate;               // Inflate a received message, or deflate a message to send
+	bool compress;              // Inflate or deflate the message, or just keep it in line with the others
+	z_stream* stream;           // The client's inflater or deflater, NULL if it couldn't be had
+	zframe_t* input;            // Compressed message, or payload to compress
+	size_t input_length;
+	bool reset;                 // Reset the zlib context first
+	byte flag;                  // JSMQ "more" flag of the payload to compress
+	size_t size_hint;           // Expected inflated size
+	byte* output;               // Compressed or inflated payload, NULL if the message couldn't be inflated
+	size_t length;
+} compression_job_t;
+
+/**
+ * Compress or inflate a message, on a compression thread; the agent thread leaves the client's
+ * zlib context alone meanwhile
+*/
+static void s_compression_job_run(void* arg) {
+	compression_job_t* self = (compression_job_t *)arg;
+
+	if (self->inflate && self->compress) {
+		if (self->stream != NULL && (!self->reset || inflateReset(self->stream) == Z_OK)) {
+			self->output = zwsdecoder_inflate(self->stream, zframe_data(self->input), zframe_size(self->input), true,
+				self->size_hint, &self->length);
+		}
+
+	} else if (self->compress) {
+		z_stream* stream = self->stream;
+		if (self->reset) {
+			deflateReset(stream);
+		}
+
+		// The output is handed over to the agent thread, so each message gets its own
+		self->output = (byte *)malloc(zwsencoder_deflate_bound(stream, self->input_length));
+		assert(self->output);
+		self->length = zwsencoder_deflate_message(stream, self->flag, zframe_data(self->input), zframe_size(self->input), self->output);
+	} else {
+		// Passed on as it is
+		return;
+	}
+	zframe_destroy(&self->input);
+}
+
+/**
+ * Whether to hand a message to the compression threads: large ones, and any queued behind them
+*/
+static bool s_agent_offload(agent_t* self, size_t pending, size_t length) {
+	return self->compressors != NULL && (pending > 0 || length >= COMPRESSION_OFFLOAD_THRESHOLD);
+}
+
+/**
+ * Hand a job to the client's compression thread
+*/
+static void s_agent_submit_job(agent_t* self, compression_job_t* job) {
+	size_t thread = zwstable_hash(zframe_data(job->client->address), zframe_size(job->client->address)) % zwspool_size(self->compressors);
+	zwspool_submit(self->compressors, thread, job);
+}
+
+static void s_agent_submit_inflate(agent_t* self, client_t* client, byte* payload, size_t length, bool compressed) {
+	compression_job_t* job = (compression_job_t *)zmalloc(sizeof(compression_job_t));
+	job->client = client;
+	job->inflate = true;
+	job->compress = compressed;
+	if (compressed) {
+		// A client without context takeover may have several messages in flight on the same borrowed inflater
+		job->stream = zwssock_client_inflater(client);
+		job->reset = client->client_no_context_takeover;
+		job->input = zframe_new(payload, length);
+		job->input_length = length;
+		job->size_hint = zwssock_client_inflate_hint(client, length);
+	} else {
+		// Received as it is, already in its own buffer
+		job->output = (byte *)malloc(length > 0 ? length : 1);
+		assert(job->output);
+		memcpy(job->output, payload, length);
+		job->length = length;
+	}
+	client->inflate_pending++;
+	s_agent_submit_job(self, job);
+}
+
+static void s_agent_submit_deflate(agent_t* self, client_t* client, zframe_t* frame, byte flag, bool deflate) {
+	compression_job_t* job = (compression_job_t *)zmalloc(sizeof(compression_job_t));
+	job->client = client;
+	job->compress = deflate;
+	job->stream = deflate ? client->deflater : NULL;
+	job->input = frame;
+	job->input_length = zframe_size(frame) + 1;
+	job->flag = flag;
+	job->reset = deflate && (client->deflate_reset_pending || client->server_no_context_takeover);
+	client->deflate_reset_pending = client->deflate_reset_pending && !deflate;
+	client->deflate_pending++;
+	s_agent_submit_job(self, job);
+}
+
+/**
+ * Pass on the result of a compression job, or just free it when `discard` is set
+*/
+static void s_agent_finish_job(agent_t* self, compression_job_t* job, bool discard) {
+	client_t* client = job->client;
+	if (job->inflate) {
+		client->inflate_pending--;
+	} else {
+		client->deflate_pending--;
+	}
+
+	if (discard || client->destroy_pending) {
+		// Nobody to pass it on to
+
+	} else if (job->inflate) {
+		if (client->state == CONNECTION_EXCEPTION) {
+			// Remaining messages of a client that sent an invalid one
+
+		} else if (job->output == NULL) {
+			zwssock_client_inflate_failed(client);
+
+		} else {
+			if (job->compress) {
+				zwssock_client_inflated(client, job->input_length, job->length);
+			}
+			client->message_flag_pending = true;
+			client->message_continued = false;
+			client->message_first_part = client->outgoing_count;
+			zwssock_client_add_buffer(client, job->output, job->length);
+			job->output = NULL;
+			zwssock_client_message_complete(client);
+		}
+
+	} else if (job->compress) {
+		outbound_t outbound = { NULL, job->output, job->output, job->length, 0, job->flag };
+		job->output = NULL;
+		s_agent_deflated(self, client, job->input_length, job->length);
+		s_agent_send_outbound(self, client, &outbound);
+
+	} else {
+		outbound_t outbound = { job->input, NULL, NULL, job->input_length, 0, job->flag };
+		job->input = NULL;
+		s_agent_send_outbound(self, client, &outbound);
+	}
+
+	zframe_destroy(&job->input);
+	free(job->output);
+	free(job);
+
+	if (client->destroy_pending && client->inflate_pending == 0 && client->deflate_pending == 0) {
+		zwssock_client_destroy(&client);
+	} else if (!client->destroy_pending) {
+		zwssock_client_release_contexts(client);
+	}
+}
+
+/**
+ * Pass on the messages the compression threads are done with
+*/
+static void s_agent_handle_compressed(agent_t* self) {
+	if (self->compressors == NULL) {
+		return;
+	}
+
+	compression_job_t* job;
+	while ((job = (compression_job_t *)zwspool_done(self->compressors)) != NULL) {
+		s_agent_finish_job(self, job, false);
+	}
+}
+
+/**
+ * Start the compression threads, unless they're running or the workers do the compression
+*/
+static void s_agent_start_compressors(agent_t* self, size_t count) {
+	if (count == 0 || self->compressors != NULL || self->worker_count > 0) {
+		return;
+	}
+
+	self->compressors = zwspool_new(count, s_compression_job_run);
+	for (size_t i = 0; i < count; i++) {
+		zpoller_add(self->poller, zwspool_socket(self->compressors, i));
+	}
+}
+
+/**
+ * Wait for the compression threads to finish their jobs, dropping the results, and stop them
+*/
+static void s_agent_stop_compressors(agent_t* self) {
+	if (self->compressors == NULL) {
+		return;
+	}
+
+	compression_job_t* job;
+	while ((job = (compression_job_t *)zwspool_wait(self->compressors)) != NULL) {
+		s_agent_finish_job(self, job, true);
+	}
+
+	if (self->poller != NULL) {
+		for (size_t i = 0; i < zwspool_size(self->compressors); i++) {
+			zpoller_remove(self->poller, zwspool_socket(self->compressors, i));
+		}
+	}
+	zwspool_destroy(&self->compressors);
+}
+
+/**
+ * Deflate a message into a frame of its own, for the deflate cache
+*/
+static bool s_agent_encode_deflated(agent_t* self, client_t* client, zframe_t* frame, byte flag, zmq_msg_t* encoded) {
+	z_stream* stream = zwszlib_deflater(self->zlib, client->server_compression_factor, self->deflate_mem_level);
+	if (stream == NULL) {
+		return false;
+	}
+
+	// Deflated after room for the largest header, then moved up against the actual header
+	byte* buffer = (byte *)malloc(10 + zwsencoder_deflate_bound(stream, zframe_size(frame) + 1));
+	assert(buffer);
+	size_t length = zwsencoder_deflate_message(stream, flag, zframe_data(frame), zframe_size(frame), buffer + 10);
+	zwszlib_release(self->zlib, &stream);
+
+	byte header_data[10];
+	uint64_t frame_size;
+	int payload_start_index;
+	zwsencoder_compute_frame_header(0xC2, length, &frame_size, &payload_start_index, header_data);
+	memcpy(buffer, header_data, payload_start_index);
+	memmove(buffer + payload_start_index, buffer + 10, length);
+
+	zmq_msg_init_data(encoded, buffer, payload_start_index + length, zwssock_free_buffer, buffer);
+	s_agent_deflated(self, NULL, zframe_size(frame) + 1, length);
+	return true;
+}
+
+/**
+ * Send a message to a client without context takeover from the deflate cache, taking ownership of
+ * the frame; returns false, leaving the frame alone, if the message isn't cached
+ *
+ * A message is cached the second time it is seen, deflated on the agent thread however large since
+ * the clients after it share the work, so a message sent once costs no more than hashing it.
+*/
+static bool s_agent_send_cached(agent_t* self, client_t* client, zframe_t* frame, byte flag) {
+	zwscache_key_t key;
+	zwscache_key(&key, flag, zframe_data(frame), zframe_size(frame), client->server_compression_factor, self->deflate_mem_level);
+
+	bool admit;
+	zmq_msg_t* cached = zwscache_lookup(self->deflate_cache, &key, zframe_data(frame), &admit);
+	if (cached != NULL) {
+		self->stats.deflate_cache_hits++;
+	} else if (admit) {
+		zmq_msg_t encoded;
+		if (!s_agent_encode_deflated(self, client, frame, flag, &encoded)) {
+			return false;
+		}
+		cached = zwscache_insert(self->deflate_cache, &key, zframe_data(frame), &encoded);
+	} else {
+		return false;
+	}
+
+	// The payload follows the header, whose length byte gives its size
+	byte length_byte = ((byte *)zmq_msg_data(cached))[1];
+	size_t header_length = length_byte == 126 ? 4 : (length_byte == 127 ? 10 : 2);
+	size_t length = zmq_msg_size(cached) - header_length;
+	zwssock_client_deflated(client, zframe_size(frame) + 1, length);
+
+	// Shared with the cache, unless the message has to wait or be fragmented
+	void* handle = zsock_resolve(self->stream);
+	bool sent = false;
+	if (zlist_size(client->outbound) == 0 && !client->blocked && (self->fragment_size == 0 || length <= self->fragment_size)) {
+		if (zmq_send(handle, zframe_data(client->address), zframe_size(client->address), ZMQ_SNDMORE | ZMQ_DONTWAIT) != -1) {
+			zmq_msg_t copy;
+			zmq_msg_init(&copy);
+			zmq_msg_copy(&copy, cached);
+			if (zmq_msg_send(&copy, handle, ZMQ_DONTWAIT) == -1) {
+				zmq_msg_close(&copy);
+			}
+			client->sending_continued = flag != 0;
+			sent = true;
+		} else {
+			// Gone, unless the stream socket only refused it for now
+			sent = errno != EAGAIN;
+		}
+	}
+	if (!sent) {
+		// Borrowed, and copied if it has to wait
+		outbound_t outbound = { NULL, NULL, (byte *)zmq_msg_data(cached) + header_length, length, 0, flag };
+		s_agent_send_outbound(self, client, &outbound);
+	}
+
+	zframe_destroy(&frame);
+	return true;
+}
+
+/**
+ * Send one frame of an outbound message to a client, taking ownership of the frame
+ *
+ * The frame becomes a WebSocket message of its own, flagged with whether more frames follow.
+*/
+static void s_agent_send_frame(agent_t* self, client_t* client, zframe_t* frame, bool message_continued) {
+	outbound_t outbound = { NULL, NULL, NULL, 0, 0, (byte)(message_continued ? 1 : 0) };
+
+	bool deflate = client->server_compression_factor > 0 && s_agent_should_deflate(self, client, zframe_size(frame));
+
+	// Without context takeover the compressed message only depends on the payload and the parameters
+	if (deflate && client->server_no_context_takeover && client->deflate_pending == 0 && zwscache_enabled(self->deflate_cache)
+			&& s_agent_send_cached(self, client, frame, outbound.flag)) {
+		return;
+	}
+	deflate = deflate && zwssock_client_deflater(client) != NULL;
+
+	// Large messages are deflated by a compression thread, and the ones behind them, compressed or not,
+	// go the same way to keep them in order
+	if (client->deflate_pending > 0 || (deflate && s_agent_offload(self, 0, zframe_size(frame)))) {
+		s_agent_submit_deflate(self, client, frame, outbound.flag, deflate);
+		return;
+	}
+
+	if (deflate) {
+		// The client's inflater has seen a broadcast deflated without our history, start afresh; a context
+		// borrowed for this message is fresh already
+		z_stream* stream = client->deflater;
+		if (client->deflate_reset_pending) {
+			deflateReset(stream);
+			client->deflate_reset_pending = false;
+		}
+
+		// Deflated into the agent's buffer, which the message borrows
+		byte* compressed_payload = s_agent_deflate_buffer(self, zwsencoder_deflate_bound(stream, zframe_size(frame) + 1));
+		size_t payload_length = zwsencoder_deflate_message(stream, outbound.flag, zframe_data(frame), zframe_size(frame), compressed_payload);
+
+		outbound.data = compressed_payload;
+		outbound.length = payload_length;
+		s_agent_deflated(self, client, zframe_size(frame) + 1, payload_length);
+		zframe_destroy(&frame);
+
+	} else {
+		outbound.frame = frame;
+		outbound.length = zframe_size(frame) + 1;
+	}
+
+	s_agent_send_outbound(self, client, &outbound);
+	if (deflate) {
+		zwssock_client_release_contexts(client);
+		s_agent_trim_deflate_buffer(self);
+	}
+}
+
+/**
+ * Prepare to broadcast the frames of `msg`, which stays owned by the caller
+*/
+static void s_broadcast_init(broadcast_t* self, zmsg_t* msg) {
+	memset(self, 0, sizeof(broadcast_t));
+	self->msg = msg;
+	for (zframe_t* frame = zmsg_first(msg); frame != NULL; frame = zmsg_next(msg)) {
+		if (zframe_size(frame) > self->largest_frame) {
+			self->largest_frame = zframe_size(frame);
+		}
+		self->payload_length += zframe_size(frame) + 1;
+	}
+}
+
+/**
+ * Drop the broadcast's references to its encoded messages, the clients' copies keep them alive until sent
+*/
+static void s_broadcast_clear(broadcast_t* self) {
+	for (int window_bits = 0; window_bits < 16; window_bits++) {
+		if (self->encoded_ready[window_bits]) {
+			zmq_msg_close(&self->encoded[window_bits]);
+		}
+	}
+}
+
+/**
+ * Free a broadcast's encoded frames once the stream socket has sent the last copy
+*/
+static void s_broadcast_free(void* data, void* hint) {
+	free(data);
+}
+
+/**
+ * Encode a broadcast message for clients deflating with a `window_bits` window (0 for no compression)
+ *
+ * All the frames of the message are encoded into one buffer, as consecutive WebSocket messages, which
+ * is shared by every client it is sent to. Compressed messages are deflated with a fresh context,
+ * borrowed from the agent's pool, as they can't refer to any client's history, and each on its own
+ * for clients that negotiated server_no_context_takeover.
+*/
+static zmq_msg_t* s_broadcast_encode(broadcast_t* self, agent_t* agent, int window_bits) {
+	if (self->encoded_ready[window_bits]) {
+		return &self->encoded[window_bits];
+	}
+
+	z_stream* stream = NULL;
+	if (window_bits > 0) {
+		stream = zwszlib_deflater(agent->zlib, window_bits, agent->deflate_mem_level);
+		assert(stream);
+	}
+
+	// Room for the largest header and the payload, however incompressible, of each frame
+	size_t size = 0;
+	for (zframe_t* frame = zmsg_first(self->msg); frame != NULL; frame = zmsg_next(self->msg)) {
+		size += 10 + (window_bits > 0 ? zwsencoder_deflate_bound(stream, zframe_size(frame) + 1) : zframe_size(frame) + 1);
+	}
+
+	byte* buffer = (byte *)malloc(size);
+	assert(buffer);
+	size_t count = zmsg_size(self->msg);
+	size_t offset = 0;
+	size_t index = 0;
+	for (zframe_t* frame = zmsg_first(self->msg); frame != NULL; frame = zmsg_next(self->msg), index++) {
+		byte flag = index + 1 < count ? 1 : 0;
+		size_t length;
+
+		// Compressed payloads are deflated in place, after room for the largest header, then moved
+		// up against the actual header
+		if (window_bits > 0) {
+			if (index > 0) {
+				deflateReset(stream);
+			}
+			length = zwsencoder_deflate_message(stream, flag, zframe_data(frame), zframe_size(frame), buffer + offset + 10);
+		} else {
+			length = zframe_size(frame) + 1;
+		}
+
+		byte header_data[10];
+		uint64_t frame_size;
+		int payload_start_index;
+		zwsencoder_compute_frame_header(window_bits > 0 ? 0xC2 : 0x82, length, &frame_size, &payload_start_index, header_data);
+		memcpy(buffer + offset, header_data, payload_start_index);
+
+		if (window_bits > 0) {
+			memmove(buffer + offset + payload_start_index, buffer + offset + 10, length);
+		} else {
+			buffer[offset + payload_start_index] = flag;
+			memcpy(buffer + offset + payload_start_index + 1, zframe_data(frame), zframe_size(frame));
+		}
+		offset += payload_start_index + length;
+		self->encoded_length[window_bits] += length;
+	}
+
+	zwszlib_release(agent->zlib, &stream);
+
+	zmq_msg_init_data(&self->encoded[window_bits], buffer, offset, s_broadcast_free, NULL);
+	self->encoded_ready[window_bits] = true;
+	return &self->encoded[window_bits];
+}
+
+/**
+ * Send a broadcast message to one client frame by frame, as an application message to it would be;
+ * returns false if the slow client policy dropped it
+*/
+static bool s_broadcast_send_frames(agent_t* self, broadcast_t* broadcast, client_t* client) {
+	if (!s_agent_admit(self, client, zmsg_size(broadcast->msg), broadcast->payload_length)) {
+		return false;
+	}
+
+	size_t remaining = zmsg_size(broadcast->msg);
+	for (zframe_t* frame = zmsg_first(broadcast->msg); frame != NULL; frame = zmsg_next(broadcast->msg)) {
+		s_agent_send_frame(self, client, zframe_dup(frame), --remaining > 0);
+	}
+	return true;
+}
+
+/**
+ * Send a broadcast message to one client, returning false if it couldn't be sent
+ *
+ * Clients with queued messages, and messages that need fragmenting, take the per-client path;
+ * otherwise the client gets a reference to the shared encoded message.
+*/
+static bool s_broadcast_send(agent_t* self, broadcast_t* broadcast, client_t* client) {
+	if (client->state != CONNECTION_CONNECTED) {
+		return false;
+	}
+
+	if (zlist_size(client->outbound) > 0 || client->deflate_pending > 0 || client->blocked
+			|| (self->fragment_size > 0 && broadcast->largest_frame + 1 > self->fragment_size)) {
+		return s_broadcast_send_frames(self, broadcast, client);
+	}
+
+	// A client that isn't reading gets the message queued, the per-client path does its own
+	// compression accounting
+	void* handle = zsock_resolve(self->stream);
+	if (zmq_send(handle, zframe_data(client->address), zframe_size(client->address), ZMQ_SNDMORE | ZMQ_DONTWAIT) == -1) {
+		return errno == EAGAIN && s_broadcast_send_frames(self, broadcast, client);
+	}
+
+	int window_bits = client->server_compression_factor;
+	if (window_bits > 0 && !s_agent_should_deflate(self, client, broadcast->largest_frame)) {
+		window_bits = 0;
+	}
+
+	bool encoding = !broadcast->encoded_ready[window_bits];
+	zmq_msg_t* encoded = s_broadcast_encode(broadcast, self, window_bits);
+	if (window_bits > 0) {
+		// Counted once per encoding, estimated for every client
+		zwssock_client_deflated(client, broadcast->payload_length, broadcast->encoded_length[window_bits]);
+		if (encoding) {
+			s_agent_deflated(self, NULL, broadcast->payload_length, broadcast->encoded_length[window_bits]);
+		}
+	}
+
+	zmq_msg_t copy;
+	zmq_msg_init(&copy);
+	zmq_msg_copy(&copy, encoded);
+	if (zmq_msg_send(&copy, handle, ZMQ_DONTWAIT) == -1) {
+		zmq_msg_close(&copy);
+		return false;
+	}
+	client->sending_continued = false;
+
+	if (window_bits > 0 && !client->server_no_context_takeover) {
+		client->deflate_reset_pending = true;
+	}
+	return true;
+}
+
+/**
+ * Handle a broadcast from zwssock_broadcast
+ *
+ * The message starts with the number of clients, or "*" for all connected clients, and their
+ * hash keys (or routing IDs). The number of clients reached and the IDs of those that weren't are
+ * sent back on the control socket.
+*/
+static void s_agent_handle_broadcast(agent_t* self, zmsg_t* request) {
+	char* count_str = zmsg_popstr(request);
+	bool all = streq(count_str, "*");
+	size_t count = all ? 0 : strtoul(count_str, NULL, 10);
+	free(count_str);
+
+	zmsg_t* failed = zmsg_new();
+	zmsg_t* targets = zmsg_new();
+	for (size_t i = 0; i < count && zmsg_size(request) > 0; i++) {
+		zframe_t* hashkey = zmsg_pop(request);
+		zmsg_append(targets, &hashkey);
+	}
+
+	broadcast_t broadcast;
+	s_broadcast_init(&broadcast, request);
+
+	size_t sent = 0;
+	if (zmsg_size(request) > 0) {
+		if (all) {
+			for (client_t* client = (client_t *)zwstable_first(self->clients); client != NULL; client = (client_t *)zwstable_next(self->clients)) {
+				if (client->state != CONNECTION_CONNECTED) {
+					continue;
+				}
+				if (s_broadcast_send(self, &broadcast, client)) {
+					sent++;
+				} else if (self->binary_routing_id) {
+					zmsg_addmem(failed, zframe_data(client->address), zframe_size(client->address));
+				} else {
+					zmsg_addstr(failed, client->hashkey);
+				}
+			}
+		} else {
+			for (zframe_t* hashkey = zmsg_first(targets); hashkey != NULL; hashkey = zmsg_next(targets)) {
+				client_t* client = s_agent_lookup(self, hashkey);
+				if (client != NULL && s_broadcast_send(self, &broadcast, client)) {
+					sent++;
+				} else {
+					zmsg_addmem(failed, zframe_data(hashkey), zframe_size(hashkey));
+				}
+			}
+		}
+	}
+
+	s_broadcast_clear(&broadcast);
+	zmsg_destroy(&targets);
+
+	char sent_str[32];
+	snprintf(sent_str, sizeof(sent_str), "%zu", sent);
+	zmsg_pushstr(failed, sent_str);
+	zmsg_send(&failed, self->control);
+}
+
+typedef struct {
+	agent_t* agent;
+	broadcast_t* broadcast;
+} publish_t;
+
+/**
+ * Send a published message to a subscriber matched by the trie, unless a shorter prefix matched it already
+*/
+static void s_agent_publish_to(void* subscriber, void* arg) {
+	publish_t* publish = (publish_t *)arg;
+	client_t* client = (client_t *)subscriber;
+
+	if (client->published != publish->agent->publish_count) {
+		client->published = publish->agent->publish_count;
+		s_broadcast_send(publish->agent, publish->broadcast, client);
+	}
+}
+
+/**
+ * Publish a message to the clients subscribed to a prefix of its first frame
+ *
+ * Like a ZeroMQ publisher, clients that can't keep up miss messages.
+*/
+static void s_agent_handle_publish(agent_t* self, zmsg_t* request) {
+	broadcast_t broadcast;
+	s_broadcast_init(&broadcast, request);
+
+	publish_t publish = { self, &broadcast };
+	self->publish_count++;
+	zframe_t* topic = zmsg_first(request);
+	zwstrie_match(self->subscriptions, zframe_data(topic), zframe_size(topic), s_agent_publish_to, &publish);
+
+	s_broadcast_clear(&broadcast);
+}
+
+/**
+ * Handle outbound messages
+ *
+ * Sends agent data to the designated client
+*/
+static int s_agent_handle_data(agent_t* self) {
+	// The first frame is client address (hashkey)
+	// If caller provides an unknown client address, the message is ignored.
+	// The assert disappears when we start to timeout clients...
+	zmsg_t* request = zmsg_recv(self->data);
+
+	// Published messages have no address
+	if (self->type == ZMQ_PUB) {
+		if (zmsg_size(request) > 0) {
+			s_agent_handle_publish(self, request);
+		}
+		zmsg_destroy(&request);
+		return 0;
+	}
+
+	zframe_t* hashkey = zmsg_pop(request);
+
+	// An empty address starts a broadcast
+	if (hashkey != NULL && zframe_size(hashkey) == 0) {
+		s_agent_handle_broadcast(self, request);
+		zframe_destroy(&hashkey);
+		zmsg_destroy(&request);
+		return 0;
+	}
+
+	client_t* client = hashkey != NULL ? s_agent_lookup(self, hashkey) : NULL;
+	zframe_destroy(&hashkey);
+
+	// Unknown client
+	if (!client) {
+		zmsg_destroy(&request);
+		return -1;
+	}
+
+	// Counted in WebSocket messages and payload bytes, flag bytes included
+	size_t length = 0;
+	for (zframe_t* frame = zmsg_first(request); frame != NULL; frame = zmsg_next(request)) {
+		length += zframe_size(frame) + 1;
+	}
+	if (!s_agent_admit(self, client, zmsg_size(request), length)) {
+		zmsg_destroy(&request);
+		return 0;
+	}
+
+	// Each frame is a full ZMQ message with identity frame
+	while (zmsg_size(request)) {
+		zframe_t* received_frame = zmsg_pop(request);
+		s_agent_send_frame(self, client, received_frame, zmsg_size(request) > 0);
+	}
+
+	zmsg_destroy(&request);
+	return 0;
+}
+
+/**
+ * Messages to a client the stream socket refused, held by the agent until it takes them
+*/
+typedef struct {
+	zframe_t* address;          //  Client's routing ID, the key in agent_t.held
+	zlist_t* messages;          //  Routing ID and data frame of each, oldest first
+} held_t;
+
+/**
+ * Send a message, routing ID first, to the stream socket without blocking; -1 with errno set if it
+ * was refused (EAGAIN) or the client is gone
+*/
+static int s_agent_try_send(agent_t* self, zmsg_t* msg) {
+	size_t remaining = zmsg_size(msg);
+	for (zframe_t* frame = zmsg_first(msg); frame != NULL; frame = zmsg_next(msg)) {
+		if (zframe_send(&frame, self->stream, ZFRAME_REUSE | ZFRAME_DONTWAIT | (--remaining > 0 ? ZFRAME_MORE : 0)) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Hold a message the stream socket refused, or one that must wait behind those held for its client
+ *
+ * A close makes the messages held before it moot. In sharded mode the worker owning the client is told
+ * to queue the messages that follow, until they are all sent.
+*/
+static void s_agent_hold(agent_t* self, zmsg_t** msg_p) {
+	zframe_t* address = zmsg_first(*msg_p);
+	held_t* held = (held_t *)zwstable_lookup(self->held, zframe_data(address), zframe_size(address));
+
+	if (held == NULL) {
+		held = (held_t *)zmalloc(sizeof(held_t));
+		held->address = zframe_dup(address);
+		held->messages = zlist_new();
+		zwstable_insert(self->held, zframe_data(held->address), zframe_size(held->address), held);
+
+		if (self->worker_count > 0) {
+			zmsg_t* notice = zmsg_new();
+			zmsg_addstr(notice, "BLOCKED");
+			zmsg_addmem(notice, zframe_data(address), zframe_size(address));
+			zmsg_send(&notice, self->workers[s_agent_shard(self, zframe_data(address), zframe_size(address))]);
+		}
+	}
+
+	if (zmsg_size(*msg_p) == 2 && zframe_size(zmsg_last(*msg_p)) == 0) {
+		zmsg_t* msg;
+		while ((msg = (zmsg_t *)zlist_pop(held->messages)) != NULL) {
+			zmsg_destroy(&msg);
+		}
+	}
+	zlist_append(held->messages, *msg_p);
+	*msg_p = NULL;
+}
+
+/**
+ * Send a message, routing ID first, to the stream socket, holding it if it has to wait
+*/
+static void s_agent_send_stream(agent_t* self, zmsg_t** msg_p) {
+	zframe_t* address = zmsg_first(*msg_p);
+	if (zwstable_lookup(self->held, zframe_data(address), zframe_size(address)) == NULL
+			&& (s_agent_try_send(self, *msg_p) == 0 || errno != EAGAIN)) {
+		zmsg_destroy(msg_p);
+		return;
+	}
+	s_agent_hold(self, msg_p);
+}
+
+/**
+ * Send the held messages the stream socket takes now, returning whether it took any
+ *
+ * Clients whose messages are all sent, or who are gone, are released, and their worker told to
+ * send again.
+*/
+static bool s_agent_send_held(agent_t* self) {
+	if (zwstable_size(self->held) == 0) {
+		return false;
+	}
+
+	// The table must not change while iterating
+	bool sent = false;
+	zlist_t* released = zlist_new();
+	for (held_t* held = (held_t *)zwstable_first(self->held); held != NULL; held = (held_t *)zwstable_next(self->held)) {
+		zmsg_t* msg;
+		while ((msg = (zmsg_t *)zlist_first(held->messages)) != NULL) {
+			if (s_agent_try_send(self, msg) == -1 && errno == EAGAIN) {
+				break;
+			}
+			zlist_pop(held->messages);
+			zmsg_destroy(&msg);
+			sent = true;
+		}
+		if (zlist_size(held->messages) == 0) {
+			zlist_append(released, held);
+		}
+	}
+
+	held_t* held;
+	while ((held = (held_t *)zlist_pop(released)) != NULL) {
+		zwstable_delete(self->held, zframe_data(held->address), zframe_size(held->address));
+		if (self->worker_count > 0) {
+			zmsg_t* notice = zmsg_new();
+			zmsg_addstr(notice, "RESUMED");
+			zmsg_addmem(notice, zframe_data(held->address), zframe_size(held->address));
+			zmsg_send(&notice, self->workers[s_agent_shard(self, zframe_data(held->address), zframe_size(held->address))]);
+		}
+		zframe_destroy(&held->address);
+		zlist_destroy(&held->messages);
+		free(held);
+	}
+	zlist_destroy(&released);
+	return sent;
+}
+
+/**
+ * Drop the held messages
+*/
+static void s_agent_destroy_held(agent_t* self) {
+	zlist_t* held_list = zlist_new();
+	for (held_t* held = (held_t *)zwstable_first(self->held); held != NULL; held = (held_t *)zwstable_next(self->held)) {
+		zlist_append(held_list, held);
+	}
+
+	held_t* held;
+	while ((held = (held_t *)zlist_pop(held_list)) != NULL) {
+		zmsg_t* msg;
+		while ((msg = (zmsg_t *)zlist_pop(held->messages)) != NULL) {
+			zmsg_destroy(&msg);
+		}
+		zlist_destroy(&held->messages);
+		zframe_destroy(&held->address);
+		free(held);
+	}
+	zlist_destroy(&held_list);
+	zwstable_destroy(&self->held);
+}
+
+//  Sharded mode: the agent thread owns the stream socket and the application's data socket, and
+//  passes messages between them and the workers, each running an agent of its own over pairs
+
+/**
+ * Move a multipart message (or the rest of one) from one socket to another without copying it
+*/
+static void s_agent_forward(void* from, void* to) {
+	zmq_msg_t part;
+	zmq_msg_init(&part);
+
+	bool more = true;
+	while (more && zmq_msg_recv(&part, from, 0) != -1) {
+		more = zmq_msg_more(&part);
+		if (zmq_msg_send(&part, to, more ? ZMQ_SNDMORE : 0) == -1) {
+			zmq_msg_close(&part);
+			zmq_msg_init(&part);
+		}
+	}
+	zmq_msg_close(&part);
+}
+
+/**
+ * Start the workers, each with a pair for client traffic and one for application traffic
+*/
+static void s_agent_start_workers(agent_t* self, size_t count) {
+	// The workers compress for their clients
+	s_agent_stop_compressors(self);
+
+	self->workers = (zactor_t **)zmalloc(count * sizeof(zactor_t*));
+	self->worker_streams = (zsock_t **)zmalloc(count * sizeof(zsock_t*));
+	self->worker_data = (zsock_t **)zmalloc(count * sizeof(zsock_t*));
+
+	for (size_t i = 0; i < count; i++) {
+		self->worker_streams[i] = zsock_new(ZMQ_PAIR);
+		self->worker_data[i] = zsock_new(ZMQ_PAIR);
+
+		// Never block between the agent and its workers, the agent holds what the stream socket refuses
+		zsock_set_sndhwm(self->worker_streams[i], 0);
+		zsock_set_rcvhwm(self->worker_streams[i], 0);
+		zsock_set_sndhwm(self->worker_data[i], 0);
+		zsock_set_rcvhwm(self->worker_data[i], 0);
+
+		int rc = zsock_bind(self->worker_streams[i], "inproc://worker-stream-%p", (void *)self->worker_streams[i]);
+		assert(rc != -1);
+		rc = zsock_bind(self->worker_data[i], "inproc://worker-data-%p", (void *)self->worker_data[i]);
+		assert(rc != -1);
+
+		self->workers[i] = zactor_new(s_agent_task, (void *)(intptr_t)self->type);
+		char data_endpoint[64], stream_endpoint[64];
+		snprintf(data_endpoint, sizeof(data_endpoint), "inproc://worker-data-%p", (void *)self->worker_data[i]);
+		snprintf(stream_endpoint, sizeof(stream_endpoint), "inproc://worker-stream-%p", (void *)self->worker_streams[i]);
+		zstr_sendx(self->workers[i], data_endpoint, stream_endpoint, NULL);
+
+		for (zframe_t* name = zmsg_first(self->options); name != NULL; name = zmsg_next(self->options)) {
+			zframe_t* value = zmsg_next(self->options);
+			zmsg_t* option = zmsg_new();
+			zmsg_addstr(option, "SET");
+			zmsg_addmem(option, zframe_data(name), zframe_size(name));
+			zmsg_addmem(option, zframe_data(value), zframe_size(value));
+			zmsg_send(&option, self->workers[i]);
+			zsock_wait(self->workers[i]);
+		}
+
+		zpoller_add(self->poller, self->workers[i]);
+		zpoller_add(self->poller, self->worker_streams[i]);
+		zpoller_add(self->poller, self->worker_data[i]);
+	}
+	self->worker_count = count;
+}
+
+/**
+ * Worker handling a routing ID
+*/
+static size_t s_agent_shard(agent_t* self, const byte* address, size_t size) {
+	return (size_t)(zwstable_hash(address, size) % self->worker_count);
+}
+
+/**
+ * Pass a message from the stream socket to the worker of its client
+*/
+static void s_agent_route_inbound(agent_t* self) {
+	void* stream = zsock_resolve(self->stream);
+	zmq_msg_t address;
+	zmq_msg_init(&address);
+	if (zmq_msg_recv(&address, stream, 0) == -1) {
+		zmq_msg_close(&address);
+		return;
+	}
+
+	void* worker = zsock_resolve(self->worker_streams[s_agent_shard(self, (byte *)zmq_msg_data(&address), zmq_msg_size(&address))]);
+	if (zmq_msg_send(&address, worker, ZMQ_SNDMORE) == -1) {
+		zmq_msg_close(&address);
+	}
+	s_agent_forward(stream, worker);
+}
+
+/**
+ * Pass a message from a worker to the stream socket, or hold it if the stream socket refuses it or
+ * messages to the same client are held already
+*/
+static void s_agent_forward_stream(agent_t* self, size_t index) {
+	void* worker = zsock_resolve(self->worker_streams[index]);
+	void* stream = zsock_resolve(self->stream);
+	zmq_msg_t address;
+	zmq_msg_init(&address);
+	if (zmq_msg_recv(&address, worker, 0) == -1) {
+		zmq_msg_close(&address);
+		return;
+	}
+
+	bool hold = zwstable_lookup(self->held, (byte *)zmq_msg_data(&address), zmq_msg_size(&address)) != NULL;
+	if (!hold) {
+		zmq_msg_t copy;
+		zmq_msg_init(&copy);
+		zmq_msg_copy(&copy, &address);
+		if (zmq_msg_send(&copy, stream, ZMQ_SNDMORE | ZMQ_DONTWAIT) != -1) {
+			s_agent_forward(worker, stream);
+			zmq_msg_close(&address);
+			return;
+		}
+		hold = errno == EAGAIN;
+		zmq_msg_close(&copy);
+	}
+
+	// The rest of the message, its data frame, dropped if the client is gone
+	zmsg_t* msg = zmsg_recv(self->worker_streams[index]);
+	if (hold && msg != NULL) {
+		zmsg_pushmem(msg, zmq_msg_data(&address), zmq_msg_size(&address));
+		s_agent_hold(self, &msg);
+	}
+	zmsg_destroy(&msg);
+	zmq_msg_close(&address);
+}
+
+/**
+ * Send the report of a broadcast to the application once all the workers involved sent theirs
+*/
+static void s_agent_broadcast_report(agent_t* self) {
+	if (self->broadcast_pending > 0) {
+		return;
+	}
+
+	char sent_str[32];
+	snprintf(sent_str, sizeof(sent_str), "%zu", self->broadcast_sent);
+	zmsg_pushstr(self->broadcast_failed, sent_str);
+	zmsg_send(&self->broadcast_failed, self->control);
+}
+
+/**
+ * Split a broadcast between the workers of its clients, or pass it to every worker
+*/
+static void s_agent_route_broadcast(agent_t* self) {
+	zmsg_t* request = zmsg_recv(self->data);
+	char* count_str = zmsg_popstr(request);
+	bool all = count_str == NULL || streq(count_str, "*");
+	size_t count = all ? 0 : strtoul(count_str, NULL, 10);
+	free(count_str);
+
+	zmsg_t** shards = (zmsg_t **)zmalloc(self->worker_count * sizeof(zmsg_t*));
+	for (size_t i = 0; i < self->worker_count; i++) {
+		shards[i] = zmsg_new();
+	}
+
+	self->broadcast_failed = zmsg_new();
+	self->broadcast_sent = 0;
+	self->broadcast_pending = 0;
+
+	for (size_t i = 0; i < count && zmsg_size(request) > 0; i++) {
+		zframe_t* hashkey = zmsg_pop(request);
+		byte buffer[256];
+		size_t size = zframe_size(hashkey);
+		const byte* address = s_agent_routing_id(self, zframe_data(hashkey), &size, buffer);
+		zmsg_append(address != NULL ? shards[s_agent_shard(self, address, size)] : self->broadcast_failed, &hashkey);
+	}
+
+	for (size_t i = 0; i < self->worker_count; i++) {
+		if (!all && zmsg_size(shards[i]) == 0) {
+			zmsg_destroy(&shards[i]);
+			continue;
+		}
+
+		char shard_count[32];
+		snprintf(shard_count, sizeof(shard_count), "%zu", zmsg_size(shards[i]));
+		for (zframe_t* frame = zmsg_first(request); frame != NULL; frame = zmsg_next(request)) {
+			zframe_t* copy = zframe_dup(frame);
+			zmsg_append(shards[i], &copy);
+		}
+		zmsg_pushstr(shards[i], all ? "*" : shard_count);
+		zmsg_pushstr(shards[i], "");
+		zmsg_send(&shards[i], self->worker_data[i]);
+		self->broadcast_pending++;
+	}
+
+	free(shards);
+	zmsg_destroy(&request);
+	s_agent_broadcast_report(self);
+}
+
+/**
+ * Pass a message from the application to the worker of its client, or to every worker
+*/
+static void s_agent_route_outbound(agent_t* self) {
+	void* data = zsock_resolve(self->data);
+	zmq_msg_t part;
+	zmq_msg_init(&part);
+	if (zmq_msg_recv(&part, data, 0) == -1) {
+		zmq_msg_close(&part);
+		return;
+	}
+
+	// Published messages go to every worker, sharing the frames
+	if (self->type == ZMQ_PUB) {
+		bool more = true;
+		while (more) {
+			more = zmq_msg_more(&part);
+			for (size_t i = 0; i < self->worker_count; i++) {
+				zmq_msg_t copy;
+				zmq_msg_init(&copy);
+				zmq_msg_copy(&copy, &part);
+				if (zmq_msg_send(&copy, zsock_resolve(self->worker_data[i]), more ? ZMQ_SNDMORE : 0) == -1) {
+					zmq_msg_close(&copy);
+				}
+			}
+			if (more && zmq_msg_recv(&part, data, 0) == -1) {
+				break;
+			}
+		}
+		zmq_msg_close(&part);
+		return;
+	}
+
+	if (zmq_msg_size(&part) == 0 && zmq_msg_more(&part)) {
+		zmq_msg_close(&part);
+		s_agent_route_broadcast(self);
+		return;
+	}
+
+	byte buffer[256];
+	size_t size = zmq_msg_size(&part);
+	const byte* address = s_agent_routing_id(self, (byte *)zmq_msg_data(&part), &size, buffer);
+
+	// Unknown client, drop the message
+	if (address == NULL) {
+		bool more = zmq_msg_more(&part);
+		while (more && zmq_msg_recv(&part, data, 0) != -1) {
+			more = zmq_msg_more(&part);
+		}
+		zmq_msg_close(&part);
+		return;
+	}
+
+	void* worker = zsock_resolve(self->worker_data[s_agent_shard(self, address, size)]);
+	bool more = zmq_msg_more(&part);
+	if (zmq_msg_send(&part, worker, more ? ZMQ_SNDMORE : 0) == -1) {
+		zmq_msg_close(&part);
+	}
+	if (more) {
+		s_agent_forward(data, worker);
+	}
+}
+
+/**
+ * Handle a message from a worker's pipe: its report on a broadcast
+*/
+static void s_agent_handle_worker_report(agent_t* self, zmsg_t* report) {
+	char* sent_str = zmsg_popstr(report);
+	if (sent_str != NULL && self->broadcast_failed != NULL) {
+		self->broadcast_sent += strtoul(sent_str, NULL, 10);
+		zframe_t* hashkey;
+		while ((hashkey = zmsg_pop(report)) != NULL) {
+			zmsg_append(self->broadcast_failed, &hashkey);
+		}
+		self->broadcast_pending--;
+		s_agent_broadcast_report(self);
+	}
+	free(sent_str);
+	zmsg_destroy(&report);
+}
+
+/**
+ * Wait for a worker to apply an option, handling the broadcast reports it sent before
+*/
+static void s_agent_wait_worker(agent_t* self, size_t index) {
+	while (true) {
+		zmsg_t* msg = zmsg_recv(self->workers[index]);
+		if (msg == NULL || zmsg_signal(msg) >= 0) {
+			zmsg_destroy(&msg);
+			return;
+		}
+		s_agent_handle_worker_report(self, msg);
+	}
+}
+
+/**
+ * Add a worker's compression counters to `stats`, handling the broadcast reports it sent before
+*/
+static void s_agent_add_worker_stats(agent_t* self, size_t index, zwssock_stats_t* stats) {
+	zstr_send(self->workers[index], "STATS");
+	while (true) {
+		zmsg_t* msg = zmsg_recv(self->workers[index]);
+		if (msg == NULL) {
+			return;
+		}
+
+		// Reports start with a short count, the counters come in one frame
+		zframe_t* frame = zmsg_first(msg);
+		if (zmsg_size(msg) != 1 || zframe_size(frame) != sizeof(zwssock_stats_t)) {
+			s_agent_handle_worker_report(self, msg);
+			continue;
+		}
+
+		zwssock_stats_t worker;
+		memcpy(&worker, zframe_data(frame), sizeof(zwssock_stats_t));
+		stats->deflated_messages += worker.deflated_messages;
+		stats->deflate_bytes_in += worker.deflate_bytes_in;
+		stats->deflate_bytes_out += worker.deflate_bytes_out;
+		stats->deflate_skipped_small += worker.deflate_skipped_small;
+		stats->deflate_skipped_ratio += worker.deflate_skipped_ratio;
+		stats->deflate_skipped_bytes += worker.deflate_skipped_bytes;
+		stats->deflate_cache_hits += worker.deflate_cache_hits;
+		stats->deflate_cache_bytes += worker.deflate_cache_bytes;
+		stats->outbound_queued_messages += worker.outbound_queued_messages;
+		stats->outbound_queued_bytes += worker.outbound_queued_bytes;
+		if (worker.outbound_queue_peak_bytes > stats->outbound_queue_peak_bytes) {
+			stats->outbound_queue_peak_bytes = worker.outbound_queue_peak_bytes;
+		}
+		stats->outbound_dropped_messages += worker.outbound_dropped_messages;
+		stats->slow_client_disconnects += worker.slow_client_disconnects;
+		stats->zlib_contexts += worker.zlib_contexts;
+		stats->zlib_pool_bytes += worker.zlib_pool_bytes;
+		stats->zlib_pool_used_bytes += worker.zlib_pool_used_bytes;
+		stats->zlib_pool_peak_bytes += worker.zlib_pool_peak_bytes;
+		stats->zlib_pool_slabs += worker.zlib_pool_slabs;
+		stats->zlib_heap_allocations += worker.zlib_heap_allocations;
+		zmsg_destroy(&msg);
+		return;
+	}
+}
+
+/**
+ * Fill in the occupancy of the agent's deflate cache and zlib context pool
+*/
+static void s_agent_add_memory_stats(agent_t* self, zwssock_stats_t* stats) {
+	zwszlib_stats_t zlib;
+	zwszlib_get_stats(self->zlib, &zlib);
+	stats->deflate_cache_bytes = zwscache_size(self->deflate_cache);
+	stats->zlib_contexts = zlib.active + zlib.idle;
+	stats->zlib_pool_bytes = zlib.held;
+	stats->zlib_pool_used_bytes = zlib.used;
+	stats->zlib_pool_peak_bytes = zlib.peak;
+	stats->zlib_pool_slabs = zlib.slabs_allocated;
+	stats->zlib_heap_allocations = zlib.heap_allocations;
+}
+
+/**
+ * Pass on what the workers send, up to a batch from each, to the stream socket and the application
+*/
+static void s_agent_handle_workers(agent_t* self) {
+	for (size_t i = 0; i < self->worker_count; i++) {
+		while (zsock_events(self->workers[i]) & ZMQ_POLLIN) {
+			s_agent_handle_worker_report(self, zmsg_recv(self->workers[i]));
+		}
+		for (size_t n = 0; n < self->batch_size && (zsock_events(self->worker_streams[i]) & ZMQ_POLLIN); n++) {
+			s_agent_forward_stream(self, i);
+		}
+		for (size_t n = 0; n < self->batch_size && s_agent_application_ready(self) && (zsock_events(self->worker_data[i]) & ZMQ_POLLIN); n++) {
+			s_agent_forward(zsock_resolve(self->worker_data[i]), zsock_resolve(self->data));
+		}
+	}
+}
+
+/**
+ * Whether the data socket takes messages for the application without blocking the agent
+*/
+static bool s_agent_application_ready(agent_t* self) {
+	return zlist_size(self->deliveries) == 0 && (zsock_events(self->data) & ZMQ_POLLOUT);
+}
+
+/**
+ * Send the application the messages waiting for room on the data socket, as far as it takes them
+*/
+static void s_agent_deliver(agent_t* self) {
+	void* handle = zsock_resolve(self->data);
+	delivery_t* delivery;
+	while ((delivery = (delivery_t *)zlist_first(self->deliveries)) != NULL) {
+		if (zmq_msg_send(&delivery->parts[0], handle, ZMQ_SNDMORE | ZMQ_DONTWAIT) == -1) {
+			return;
+		}
+		for (size_t i = 1; i < delivery->count; i++) {
+			if (zmq_msg_send(&delivery->parts[i], handle, i + 1 < delivery->count ? ZMQ_SNDMORE : 0) == -1) {
+				zmq_msg_close(&delivery->parts[i]);
+			}
+		}
+		zlist_pop(self->deliveries);
+		free(delivery->parts);
+		free(delivery);
+	}
+}
+
+/**
+ * Drop the messages waiting for the application
+*/
+static void s_agent_destroy_deliveries(agent_t* self) {
+	delivery_t* delivery;
+	while ((delivery = (delivery_t *)zlist_pop(self->deliveries)) != NULL) {
+		for (size_t i = 0; i < delivery->count; i++) {
+			zmq_msg_close(&delivery->parts[i]);
+		}
+		free(delivery->parts);
+		free(delivery);
+	}
+	zlist_destroy(&self->deliveries);
+}
+
+/**
+ * Stop waking up for client traffic while the application isn't reading hers, or start again
+ *
+ * The agent keeps handling the control and data sockets meanwhile, so the application's requests
+ * (broadcasts, stats, options) are answered whatever it has left unread.
+*/
+static void s_agent_pause_inbound(agent_t* self, bool pause) {
+	if (pause == self->inbound_paused) {
+		return;
+	}
+	self->inbound_paused = pause;
+
+	if (pause) {
+		zpoller_remove(self->poller, self->stream);
+	} else {
+		zpoller_add(self->poller, self->stream);
+	}
+	for (size_t i = 0; i < self->worker_count; i++) {
+		if (pause) {
+			zpoller_remove(self->poller, self->worker_data[i]);
+		} else {
+			zpoller_add(self->poller, self->worker_data[i]);
+		}
+	}
+}
+
+/**
+ * Handle the messages waiting on the stream and data sockets, up to a batch from each
+ *
+ * Both directions take turns one message at a time so neither starves the other. The sockets'
+ * ZMQ_EVENTS tell whether a message is waiting, so reading never blocks.
+*/
+static void s_agent_handle_batch(agent_t* self) {
+	size_t inbound = 0;
+	size_t outbound = 0;
+	bool handled = true;
+
+	while (handled) {
+		handled = false;
+		// Client messages only while the application has room for what they turn into
+		if (inbound < self->batch_size && s_agent_application_ready(self) && (zsock_events(self->stream) & ZMQ_POLLIN)) {
+			if (self->worker_count > 0) {
+				s_agent_route_inbound(self);
+			} else {
+				s_agent_handle_router(self);
+			}
+			inbound++;
+			handled = true;
+		}
+		if (outbound < self->batch_size && (zsock_events(self->data) & ZMQ_POLLIN)) {
+			if (self->worker_count > 0) {
+				s_agent_route_outbound(self);
+			} else {
+				s_agent_handle_data(self);
+			}
+			outbound++;
+			handled = true;
+		}
+	}
+
+	self->stats.inbound_messages += inbound;
+	self->stats.outbound_messages += outbound;
+	if (inbound > self->stats.inbound_batch_max) {
+		self->stats.inbound_batch_max = inbound;
+	}
+	if (outbound > self->stats.outbound_batch_max) {
+		self->stats.outbound_batch_max = outbound;
+	}
+
+	// Bucket i counts batches of 2^i to 2^(i+1) - 1 messages, the last one everything larger
+	size_t total = inbound + outbound;
+	if (total > 0) {
+		int bucket = 0;
+		while (total > 1 && bucket < ZWSSOCK_BATCH_BUCKETS - 1) {
+			total >>= 1;
+			bucket++;
+		}
+		self->stats.batch_histogram[bucket]++;
+	}
+}
+
+void s_agent_task(zsock_t* control, void* args) {
+	// Let the main thread continue
+	zsock_signal(control, 0);
+
+	// Create agent instance as we start this task
+	agent_t* self = s_agent_new(control, (int)(intptr_t)args);
+	if (!self)                  //  Interrupted
+		return;
+
+	zpoller_t* poller = zpoller_new(self->control, self->stream, self->data, NULL);
+	assert(poller);
+	self->poller = poller;
+
+	void* which;
+
+	while (true) {
+		// Don't block while messages are waiting to be sent, but only retry now and then those the stream
+		// socket refused last time
+		int timeout = -1;
+		if (zlist_size(self->sending) > 0 || zwstable_size(self->held) > 0) {
+			timeout = self->sending_stalled ? SEND_RETRY_INTERVAL : 0;
+		}
+		// Nothing wakes the agent when the application reads, check on it now and then
+		if (self->inbound_paused && timeout == -1) {
+			timeout = SEND_RETRY_INTERVAL;
+		}
+		which = zpoller_wait(poller, timeout);
+		self->stats.wakeups++;
+
+		if (zpoller_terminated(poller)) {
+			break;
+
+		} if (which == self->control) {
+			// Something went wrong
+			// TODO: use modern CZMQ patterns for handling control pipe
+			if (s_agent_handle_control(self) == -1) {
+				break;
+			}
+		}
+
+		s_agent_handle_batch(self);
+		s_agent_handle_compressed(self);
+		s_agent_handle_workers(self);
+		bool sent = s_agent_send_held(self);
+		sent = s_agent_send_fragments(self) || sent;
+		self->sending_stalled = !sent;
+
+		s_agent_deliver(self);
+		s_agent_pause_inbound(self, !s_agent_application_ready(self));
 	}
 
 	//  Done, free all agent resources
 	zpoller_destroy(&poller);
+	self->poller = NULL;
 	s_agent_destroy(&self);
 }
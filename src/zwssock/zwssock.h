@@ -11,18 +11,104 @@ extern "C" {
 
 typedef struct _zwssock_t zwssock_t;
 
+#define ZWSSOCK_BATCH_BUCKETS 8
+
+// What happens to the messages for a client whose outbound queue is full, see zwssock_set_slow_client_policy
+typedef enum {
+	ZWSSOCK_DROP_NEWEST = 0,                          // Drop the message being sent
+	ZWSSOCK_DROP_OLDEST = 1,                          // Drop the oldest queued messages to make room for it
+	ZWSSOCK_DISCONNECT = 2                            // Drop the queue and close the connection
+} zwssock_slow_client_policy_t;
+
+// Agent counters, see zwssock_get_stats
+typedef struct {
+	uint64_t wakeups;                                 // Poller wakeups of the agent
+	uint64_t inbound_messages;                        // Reads handled from clients
+	uint64_t outbound_messages;                       // Messages handled from the application
+	uint64_t inbound_batch_max;                       // Most reads handled in one wakeup
+	uint64_t outbound_batch_max;                      // Most application messages handled in one wakeup
+	uint64_t batch_histogram[ZWSSOCK_BATCH_BUCKETS];  // Wakeups by messages handled: 1, 2-3, 4-7, ... 128+
+	uint64_t deflated_messages;                       // Messages sent compressed (broadcasts count once per encoding)
+	uint64_t deflate_bytes_in;                        // Their size before compression
+	uint64_t deflate_bytes_out;                       // Their size after compression
+	uint64_t deflate_skipped_small;                   // Messages sent uncompressed for being under the compression threshold
+	uint64_t deflate_skipped_ratio;                   // Messages sent uncompressed to clients whose messages don't shrink
+	uint64_t deflate_skipped_bytes;                   // Size of the messages sent uncompressed, the deflate work saved
+	uint64_t deflate_cache_hits;                      // Messages sent from the deflate cache, see zwssock_set_deflate_cache_size
+	uint64_t deflate_cache_bytes;                     // Memory held by the cache
+	uint64_t outbound_queued_messages;                // WebSocket messages waiting for their client to read, see zwssock_set_outbound_queue_bytes
+	uint64_t outbound_queued_bytes;                   // Their payload size
+	uint64_t outbound_queue_peak_bytes;               // Most payload bytes queued for one client
+	uint64_t outbound_dropped_messages;               // WebSocket messages dropped by the slow client policy
+	uint64_t slow_client_disconnects;                 // Clients disconnected by it
+	uint64_t zlib_contexts;                           // zlib contexts in use or kept ready, see zwssock_set_zlib_pool_size
+	uint64_t zlib_pool_bytes;                         // Memory held in slabs for them
+	uint64_t zlib_pool_used_bytes;                    // Part of it in use
+	uint64_t zlib_pool_peak_bytes;                    // Most memory held in slabs at once (summed over the agent and its workers)
+	uint64_t zlib_pool_slabs;                         // Slabs allocated from the heap
+	uint64_t zlib_heap_allocations;                   // zlib allocations served by the heap, past the pool size
+} zwssock_stats_t;
+
 CZMQ_EXPORT zwssock_t* zwssock_new_router();
 
+CZMQ_EXPORT zwssock_t* zwssock_new_publisher();
+
 CZMQ_EXPORT void zwssock_destroy(zwssock_t** self_p);
 
 CZMQ_EXPORT int zwssock_bind(zwssock_t* self, const char* endpoint);
 
 CZMQ_EXPORT int zwssock_send(zwssock_t* self, zmsg_t** msg_p);
 
+CZMQ_EXPORT int zwssock_broadcast(zwssock_t* self, zlist_t* clients, zmsg_t** msg_p, zlist_t** failed_p);
+
 CZMQ_EXPORT zmsg_t* zwssock_recv(zwssock_t* self);
 
 CZMQ_EXPORT zsock_t* zwssock_handle(zwssock_t* self);
 
+CZMQ_EXPORT void zwssock_set_max_message_size(zwssock_t* self, size_t max_message_size);
+
+CZMQ_EXPORT void zwssock_set_fragment_streaming(zwssock_t* self, bool fragment_streaming);
+
+CZMQ_EXPORT void zwssock_set_fragment_size(zwssock_t* self, size_t fragment_size);
+
+CZMQ_EXPORT void zwssock_set_buffer_pool_size(zwssock_t* self, size_t buffer_pool_size);
+
+CZMQ_EXPORT void zwssock_set_zlib_pool_size(zwssock_t* self, size_t zlib_pool_size);
+
+CZMQ_EXPORT void zwssock_set_deflate_cache_size(zwssock_t* self, size_t deflate_cache_size);
+
+CZMQ_EXPORT void zwssock_set_outbound_queue_bytes(zwssock_t* self, size_t outbound_queue_bytes);
+
+CZMQ_EXPORT void zwssock_set_outbound_queue_messages(zwssock_t* self, size_t outbound_queue_messages);
+
+CZMQ_EXPORT void zwssock_set_slow_client_policy(zwssock_t* self, zwssock_slow_client_policy_t policy);
+
+CZMQ_EXPORT void zwssock_set_binary_routing_id(zwssock_t* self, bool binary_routing_id);
+
+CZMQ_EXPORT void zwssock_set_batch_size(zwssock_t* self, size_t batch_size);
+
+CZMQ_EXPORT void zwssock_set_workers(zwssock_t* self, size_t workers);
+
+CZMQ_EXPORT void zwssock_set_compression_threads(zwssock_t* self, size_t threads);
+
+CZMQ_EXPORT void zwssock_set_compression_threshold(zwssock_t* self, size_t threshold);
+
+CZMQ_EXPORT void zwssock_set_compression_ratio(zwssock_t* self, unsigned int percent);
+
+CZMQ_EXPORT void zwssock_set_compression(zwssock_t* self, bool compression);
+
+CZMQ_EXPORT void zwssock_set_server_max_window_bits(zwssock_t* self, int bits);
+
+CZMQ_EXPORT void zwssock_set_client_max_window_bits(zwssock_t* self, int bits);
+
+CZMQ_EXPORT void zwssock_set_server_no_context_takeover(zwssock_t* self, bool no_context_takeover);
+
+CZMQ_EXPORT void zwssock_set_client_no_context_takeover(zwssock_t* self, bool no_context_takeover);
+
+CZMQ_EXPORT void zwssock_set_deflate_mem_level(zwssock_t* self, int level);
+
+CZMQ_EXPORT void zwssock_get_stats(zwssock_t* self, zwssock_stats_t* stats);
+
 #ifdef __cplusplus
 }
 #endif
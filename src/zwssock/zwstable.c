@@ -0,0 +1,161 @@
+#include "zwstable.h"
+
+#define ZWSTABLE_MIN_CAPACITY 64    // Always a power of two, kept at most half full
+
+typedef struct {
+	const byte* key;            // NULL for a free slot
+	size_t key_size;
+	uint64_t hash;
+	void* item;
+} zwstable_slot_t;
+
+struct _zwstable_t {
+	zwstable_slot_t* slots;
+	size_t capacity;
+	size_t size;
+	size_t cursor;              // Next slot to look at when iterating
+};
+
+
+// Private methods
+static size_t zwstable_find(zwstable_t* self, const byte* key, size_t size, uint64_t hash);
+static void zwstable_grow(zwstable_t* self);
+
+
+zwstable_t* zwstable_new() {
+	zwstable_t* self = zmalloc(sizeof(zwstable_t));
+	self->capacity = ZWSTABLE_MIN_CAPACITY;
+	self->slots = (zwstable_slot_t *)zmalloc(self->capacity * sizeof(zwstable_slot_t));
+	return self;
+}
+
+void zwstable_destroy(zwstable_t** self_p) {
+	zwstable_t* self = *self_p;
+	if (self) {
+		free(self->slots);
+		free(self);
+		*self_p = NULL;
+	}
+}
+
+void zwstable_insert(zwstable_t* self, const byte* key, size_t size, void* item) {
+	if ((self->size + 1) * 2 > self->capacity) {
+		zwstable_grow(self);
+	}
+
+	uint64_t hash = zwstable_hash(key, size);
+	size_t index = zwstable_find(self, key, size, hash);
+	assert(self->slots[index].key == NULL);
+
+	self->slots[index].key = key;
+	self->slots[index].key_size = size;
+	self->slots[index].hash = hash;
+	self->slots[index].item = item;
+	self->size++;
+}
+
+void* zwstable_lookup(zwstable_t* self, const byte* key, size_t size) {
+	size_t index = zwstable_find(self, key, size, zwstable_hash(key, size));
+	return self->slots[index].key != NULL ? self->slots[index].item : NULL;
+}
+
+/**
+ * Remove an item, shifting back the items that follow it in its probe sequence so that lookups
+ * never need tombstones
+*/
+void* zwstable_delete(zwstable_t* self, const byte* key, size_t size) {
+	size_t mask = self->capacity - 1;
+	size_t index = zwstable_find(self, key, size, zwstable_hash(key, size));
+	if (self->slots[index].key == NULL) {
+		return NULL;
+	}
+
+	void* item = self->slots[index].item;
+	size_t next = index;
+	while (true) {
+		next = (next + 1) & mask;
+		if (self->slots[next].key == NULL) {
+			break;
+		}
+
+		// Leave items that sit between their home slot and the hole
+		size_t home = self->slots[next].hash & mask;
+		bool reachable = index <= next ? (index < home && home <= next) : (index < home || home <= next);
+		if (!reachable) {
+			self->slots[index] = self->slots[next];
+			index = next;
+		}
+	}
+
+	self->slots[index].key = NULL;
+	self->slots[index].item = NULL;
+	self->size--;
+	return item;
+}
+
+size_t zwstable_size(zwstable_t* self) {
+	return self->size;
+}
+
+void* zwstable_first(zwstable_t* self) {
+	self->cursor = 0;
+	return zwstable_next(self);
+}
+
+void* zwstable_next(zwstable_t* self) {
+	while (self->cursor < self->capacity) {
+		zwstable_slot_t* slot = &self->slots[self->cursor++];
+		if (slot->key != NULL) {
+			return slot->item;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * FNV-1a, routing IDs are short
+*/
+uint64_t zwstable_hash(const byte* key, size_t size) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= key[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/**
+ * Index of the slot holding `key`, or of the free slot ending its probe sequence
+*/
+static size_t zwstable_find(zwstable_t* self, const byte* key, size_t size, uint64_t hash) {
+	size_t mask = self->capacity - 1;
+	size_t index = hash & mask;
+
+	while (self->slots[index].key != NULL) {
+		zwstable_slot_t* slot = &self->slots[index];
+		if (slot->hash == hash && slot->key_size == size && memcmp(slot->key, key, size) == 0) {
+			break;
+		}
+		index = (index + 1) & mask;
+	}
+	return index;
+}
+
+static void zwstable_grow(zwstable_t* self) {
+	zwstable_slot_t* slots = self->slots;
+	size_t capacity = self->capacity;
+
+	self->capacity *= 2;
+	self->slots = (zwstable_slot_t *)zmalloc(self->capacity * sizeof(zwstable_slot_t));
+
+	for (size_t i = 0; i < capacity; i++) {
+		if (slots[i].key != NULL) {
+			size_t index = slots[i].hash & (self->capacity - 1);
+			while (self->slots[index].key != NULL) {
+				index = (index + 1) & (self->capacity - 1);
+			}
+			self->slots[index] = slots[i];
+		}
+	}
+	free(slots);
+}
@@ -0,0 +1,41 @@
+#ifndef ZWSTABLE_H_
+#define ZWSTABLE_H_
+
+#include <czmq.h>
+
+// Open-addressing hash table keyed by binary routing IDs
+typedef struct _zwstable_t zwstable_t;
+
+zwstable_t* zwstable_new();
+
+// Items are not freed, destroy them first
+void zwstable_destroy(zwstable_t** self_p);
+
+// The key isn't copied, it must stay valid while the item is in the table (the item usually owns it)
+void zwstable_insert(zwstable_t* self, const byte* key, size_t size, void* item);
+
+// Returns the item, or NULL if the key isn't in the table
+void* zwstable_lookup(zwstable_t* self, const byte* key, size_t size);
+
+// Returns the removed item, or NULL if the key isn't in the table
+void* zwstable_delete(zwstable_t* self, const byte* key, size_t size);
+
+size_t zwstable_size(zwstable_t* self);
+
+// Hash of a key, as used by the table; also spreads routing IDs over worker threads
+uint64_t zwstable_hash(const byte* key, size_t size);
+
+// Iterate over the items in no particular order; the table must not change while iterating
+void* zwstable_first(zwstable_t* self);
+
+void* zwstable_next(zwstable_t* self);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // ZWSTABLE_H_
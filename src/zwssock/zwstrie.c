@@ -0,0 +1,197 @@
+#include "zwstrie.h"
+
+typedef struct _zwstrie_node_t zwstrie_node_t;
+
+typedef struct {
+	void* subscriber;
+	size_t count;               // Times the subscriber subscribed to this prefix
+} zwstrie_subscription_t;
+
+// One node per prefix byte; children are kept sorted by byte for a binary search
+struct _zwstrie_node_t {
+	byte* keys;
+	zwstrie_node_t** children;
+	size_t child_count;
+	size_t child_capacity;
+
+	zwstrie_subscription_t* subscriptions;
+	size_t subscription_count;
+	size_t subscription_capacity;
+};
+
+struct _zwstrie_t {
+	zwstrie_node_t root;        // The empty prefix, matching every topic
+};
+
+
+// Private methods
+static size_t zwstrie_node_find(zwstrie_node_t* self, byte key, bool* found);
+static zwstrie_node_t* zwstrie_node_child(zwstrie_node_t* self, byte key);
+static zwstrie_node_t* zwstrie_node_add_child(zwstrie_node_t* self, byte key);
+static void zwstrie_node_remove_child(zwstrie_node_t* self, byte key);
+static void zwstrie_node_clear(zwstrie_node_t* self);
+
+
+zwstrie_t* zwstrie_new() {
+	zwstrie_t* self = zmalloc(sizeof(zwstrie_t));
+	return self;
+}
+
+void zwstrie_destroy(zwstrie_t** self_p) {
+	zwstrie_t* self = *self_p;
+	if (self) {
+		zwstrie_node_clear(&self->root);
+		free(self);
+		*self_p = NULL;
+	}
+}
+
+void zwstrie_insert(zwstrie_t* self, const byte* prefix, size_t size, void* subscriber) {
+	zwstrie_node_t* node = &self->root;
+	for (size_t i = 0; i < size; i++) {
+		zwstrie_node_t* child = zwstrie_node_child(node, prefix[i]);
+		node = child != NULL ? child : zwstrie_node_add_child(node, prefix[i]);
+	}
+
+	for (size_t i = 0; i < node->subscription_count; i++) {
+		if (node->subscriptions[i].subscriber == subscriber) {
+			node->subscriptions[i].count++;
+			return;
+		}
+	}
+
+	if (node->subscription_count == node->subscription_capacity) {
+		node->subscription_capacity = node->subscription_capacity ? node->subscription_capacity * 2 : 4;
+		node->subscriptions = (zwstrie_subscription_t *)realloc(node->subscriptions, node->subscription_capacity * sizeof(zwstrie_subscription_t));
+		assert(node->subscriptions);
+	}
+	node->subscriptions[node->subscription_count].subscriber = subscriber;
+	node->subscriptions[node->subscription_count].count = 1;
+	node->subscription_count++;
+}
+
+/**
+ * Remove a subscription, then the nodes left with neither subscriptions nor children
+*/
+bool zwstrie_remove(zwstrie_t* self, const byte* prefix, size_t size, void* subscriber) {
+	// Nodes along the prefix, to prune them bottom up
+	zwstrie_node_t** path = (zwstrie_node_t **)zmalloc((size + 1) * sizeof(zwstrie_node_t*));
+	path[0] = &self->root;
+	for (size_t i = 0; i < size; i++) {
+		path[i + 1] = zwstrie_node_child(path[i], prefix[i]);
+		if (path[i + 1] == NULL) {
+			free(path);
+			return false;
+		}
+	}
+
+	zwstrie_node_t* node = path[size];
+	size_t index = 0;
+	while (index < node->subscription_count && node->subscriptions[index].subscriber != subscriber) {
+		index++;
+	}
+	if (index == node->subscription_count) {
+		free(path);
+		return false;
+	}
+
+	if (--node->subscriptions[index].count == 0) {
+		node->subscriptions[index] = node->subscriptions[--node->subscription_count];
+	}
+
+	for (size_t i = size; i > 0; i--) {
+		node = path[i];
+		if (node->subscription_count > 0 || node->child_count > 0) {
+			break;
+		}
+		zwstrie_node_remove_child(path[i - 1], prefix[i - 1]);
+	}
+
+	free(path);
+	return true;
+}
+
+void zwstrie_match(zwstrie_t* self, const byte* topic, size_t size, zwstrie_match_fn match_fn, void* arg) {
+	zwstrie_node_t* node = &self->root;
+	size_t i = 0;
+
+	while (node != NULL) {
+		for (size_t j = 0; j < node->subscription_count; j++) {
+			match_fn(node->subscriptions[j].subscriber, arg);
+		}
+		node = i < size ? zwstrie_node_child(node, topic[i++]) : NULL;
+	}
+}
+
+/**
+ * Index of the child for `key`, or of where it would be inserted
+*/
+static size_t zwstrie_node_find(zwstrie_node_t* self, byte key, bool* found) {
+	size_t low = 0;
+	size_t high = self->child_count;
+
+	while (low < high) {
+		size_t middle = (low + high) / 2;
+		if (self->keys[middle] < key) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+
+	*found = low < self->child_count && self->keys[low] == key;
+	return low;
+}
+
+static zwstrie_node_t* zwstrie_node_child(zwstrie_node_t* self, byte key) {
+	bool found;
+	size_t index = zwstrie_node_find(self, key, &found);
+	return found ? self->children[index] : NULL;
+}
+
+static zwstrie_node_t* zwstrie_node_add_child(zwstrie_node_t* self, byte key) {
+	bool found;
+	size_t index = zwstrie_node_find(self, key, &found);
+	assert(!found);
+
+	if (self->child_count == self->child_capacity) {
+		self->child_capacity = self->child_capacity ? self->child_capacity * 2 : 2;
+		self->keys = (byte *)realloc(self->keys, self->child_capacity);
+		self->children = (zwstrie_node_t **)realloc(self->children, self->child_capacity * sizeof(zwstrie_node_t*));
+		assert(self->keys && self->children);
+	}
+
+	memmove(self->keys + index + 1, self->keys + index, self->child_count - index);
+	memmove(self->children + index + 1, self->children + index, (self->child_count - index) * sizeof(zwstrie_node_t*));
+	self->keys[index] = key;
+	self->children[index] = (zwstrie_node_t *)zmalloc(sizeof(zwstrie_node_t));
+	self->child_count++;
+	return self->children[index];
+}
+
+static void zwstrie_node_remove_child(zwstrie_node_t* self, byte key) {
+	bool found;
+	size_t index = zwstrie_node_find(self, key, &found);
+	assert(found);
+
+	zwstrie_node_clear(self->children[index]);
+	free(self->children[index]);
+
+	self->child_count--;
+	memmove(self->keys + index, self->keys + index + 1, self->child_count - index);
+	memmove(self->children + index, self->children + index + 1, (self->child_count - index) * sizeof(zwstrie_node_t*));
+}
+
+/**
+ * Free a node's children and subscriptions, but not the node itself
+*/
+static void zwstrie_node_clear(zwstrie_node_t* self) {
+	for (size_t i = 0; i < self->child_count; i++) {
+		zwstrie_node_clear(self->children[i]);
+		free(self->children[i]);
+	}
+	free(self->keys);
+	free(self->children);
+	free(self->subscriptions);
+	memset(self, 0, sizeof(zwstrie_node_t));
+}
@@ -0,0 +1,34 @@
+#ifndef ZWSTRIE_H_
+#define ZWSTRIE_H_
+
+#include <czmq.h>
+
+// Prefix trie of topic subscriptions, matching a topic in time proportional to its length
+typedef struct _zwstrie_t zwstrie_t;
+
+typedef void (*zwstrie_match_fn)(void* subscriber, void* arg);
+
+zwstrie_t* zwstrie_new();
+
+void zwstrie_destroy(zwstrie_t** self_p);
+
+// Subscribe to every topic starting with `prefix`; a subscriber may subscribe to the same prefix
+// more than once, and then has to unsubscribe as many times
+void zwstrie_insert(zwstrie_t* self, const byte* prefix, size_t size, void* subscriber);
+
+// Returns false if the subscriber wasn't subscribed to `prefix`
+bool zwstrie_remove(zwstrie_t* self, const byte* prefix, size_t size, void* subscriber);
+
+// Call `match_fn` for each subscription to a prefix of `topic`; a subscriber to several of
+// its prefixes is matched once per prefix
+void zwstrie_match(zwstrie_t* self, const byte* topic, size_t size, zwstrie_match_fn match_fn, void* arg);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // ZWSTRIE_H_
@@ -0,0 +1,381 @@
+#include "zwszlib.h"
+
+#define ZWSZLIB_DEFLATE_WINDOWS 7   // Deflate windows of 9 to 15 bits; zlib can't deflate raw with 8
+#define ZWSZLIB_MEM_LEVELS 9
+#define ZWSZLIB_INFLATE_WINDOWS 8   // Inflate windows of 8 to 15 bits
+#define ZWSZLIB_SIZE_CLASSES 32     // zlib asks for a handful of sizes per window and memLevel, others come from the heap
+#define ZWSZLIB_SLAB_SIZE 65536     // Smaller blocks share a slab, larger ones get a slab each
+#define ZWSZLIB_ALIGNMENT 16
+
+typedef struct _zwszlib_context_t zwszlib_context_t;
+typedef struct _zwszlib_slab_t zwszlib_slab_t;
+typedef struct _zwszlib_block_t zwszlib_block_t;
+
+// Contexts are handed out as their stream, which comes first
+struct _zwszlib_context_t {
+	z_stream stream;
+	bool deflate;
+	int window_bits;
+	int mem_level;
+	zwszlib_context_t* next;    // Next idle context with the same parameters
+};
+
+// Header in front of every allocation handed to zlib
+struct _zwszlib_block_t {
+	zwszlib_slab_t* slab;       // NULL for a heap allocation
+	zwszlib_block_t* next;      // Next free block of the slab
+};
+
+// Blocks of one size class, carved as they are first needed; the header keeps them aligned
+struct _zwszlib_slab_t {
+	zwszlib_slab_t* prev;       // Neighbours among the slabs of the class with a block to spare
+	zwszlib_slab_t* next;
+	zwszlib_block_t* free;      // Blocks returned by zlib
+	size_t carved;
+	size_t used;
+	size_t size_class;
+};
+
+typedef struct {
+	size_t size;                // Allocation size, 0 while the class is unused
+	size_t stride;              // Block size, header included
+	size_t blocks;              // Blocks per slab
+	zwszlib_slab_t* spare;      // Slabs with a block free or left to carve
+} zwszlib_class_t;
+
+struct _zwszlib_t {
+	zwszlib_context_t* deflaters[ZWSZLIB_DEFLATE_WINDOWS][ZWSZLIB_MEM_LEVELS];  // Idle, by window bits and memLevel
+	zwszlib_context_t* inflaters[ZWSZLIB_INFLATE_WINDOWS];                     // Idle, by window bits
+	zwszlib_class_t classes[ZWSZLIB_SIZE_CLASSES];
+	size_t max_idle;
+	size_t ceiling;
+	zwszlib_stats_t stats;
+};
+
+
+// Private methods
+static zwszlib_context_t* zwszlib_context_new(zwszlib_t* self);
+static zwszlib_context_t** zwszlib_idle_list(zwszlib_t* self, bool deflate, int window_bits, int mem_level);
+static void zwszlib_end(zwszlib_context_t* context);
+static voidpf zwszlib_alloc(voidpf opaque, uInt items, uInt size);
+static void zwszlib_free(voidpf opaque, voidpf address);
+static size_t zwszlib_size_class(zwszlib_t* self, size_t size);
+static zwszlib_slab_t* zwszlib_slab_new(zwszlib_t* self, size_t size_class);
+static void zwszlib_slab_destroy(zwszlib_t* self, zwszlib_slab_t* slab);
+static void zwszlib_unlink(zwszlib_class_t* size_class, zwszlib_slab_t* slab);
+static void zwszlib_trim(zwszlib_t* self, size_t needed);
+
+
+zwszlib_t* zwszlib_new(size_t max_idle, size_t ceiling) {
+	zwszlib_t* self = zmalloc(sizeof(zwszlib_t));
+	self->max_idle = max_idle;
+	self->ceiling = ceiling;
+	return self;
+}
+
+void zwszlib_destroy(zwszlib_t** self_p) {
+	zwszlib_t* self = *self_p;
+	if (self) {
+		assert(self->stats.active == 0);
+		for (int window = 0; window < ZWSZLIB_DEFLATE_WINDOWS; window++) {
+			for (int level = 0; level < ZWSZLIB_MEM_LEVELS; level++) {
+				while (self->deflaters[window][level] != NULL) {
+					zwszlib_context_t* context = self->deflaters[window][level];
+					self->deflaters[window][level] = context->next;
+					zwszlib_end(context);
+				}
+			}
+		}
+		for (int window = 0; window < ZWSZLIB_INFLATE_WINDOWS; window++) {
+			while (self->inflaters[window] != NULL) {
+				zwszlib_context_t* context = self->inflaters[window];
+				self->inflaters[window] = context->next;
+				zwszlib_end(context);
+			}
+		}
+
+		// Every block is back, so every slab is spare
+		assert(self->stats.used == 0);
+		self->ceiling = 0;
+		zwszlib_trim(self, 0);
+		free(self);
+		*self_p = NULL;
+	}
+}
+
+void zwszlib_set_ceiling(zwszlib_t* self, size_t ceiling) {
+	self->ceiling = ceiling;
+	zwszlib_trim(self, 0);
+}
+
+z_stream* zwszlib_deflater(zwszlib_t* self, int window_bits, int mem_level) {
+	assert(window_bits >= 9 && window_bits <= 15 && mem_level >= 1 && mem_level <= 9);
+	zwszlib_context_t** idle = zwszlib_idle_list(self, true, window_bits, mem_level);
+	zwszlib_context_t* context = *idle;
+
+	if (context != NULL) {
+		*idle = context->next;
+		self->stats.idle--;
+	} else {
+		context = zwszlib_context_new(self);
+		if (deflateInit2(&context->stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -window_bits, mem_level, Z_DEFAULT_STRATEGY) != Z_OK) {
+			free(context);
+			return NULL;
+		}
+		context->deflate = true;
+		context->window_bits = window_bits;
+		context->mem_level = mem_level;
+	}
+
+	self->stats.active++;
+	return &context->stream;
+}
+
+z_stream* zwszlib_inflater(zwszlib_t* self, int window_bits) {
+	assert(window_bits >= 8 && window_bits <= 15);
+	zwszlib_context_t** idle = zwszlib_idle_list(self, false, window_bits, 0);
+	zwszlib_context_t* context = *idle;
+
+	if (context != NULL) {
+		*idle = context->next;
+		self->stats.idle--;
+	} else {
+		context = zwszlib_context_new(self);
+		if (inflateInit2(&context->stream, -window_bits) != Z_OK) {
+			free(context);
+			return NULL;
+		}
+
+		// inflate allocates its window on first use, possibly on a compression thread; an empty
+		// dictionary makes it allocate the window here, on the thread owning the slabs
+		static const Bytef no_dictionary[1] = { 0 };
+		if (inflateSetDictionary(&context->stream, no_dictionary, 0) != Z_OK) {
+			zwszlib_end(context);
+			return NULL;
+		}
+		context->window_bits = window_bits;
+	}
+
+	self->stats.active++;
+	return &context->stream;
+}
+
+void zwszlib_release(zwszlib_t* self, z_stream** stream_p) {
+	if (*stream_p == NULL) {
+		return;
+	}
+
+	zwszlib_context_t* context = (zwszlib_context_t *)*stream_p;
+	*stream_p = NULL;
+	self->stats.active--;
+
+	if (self->stats.idle >= self->max_idle) {
+		zwszlib_end(context);
+		return;
+	}
+
+	// Reset now, the next borrower starts a message right away
+	int rc = context->deflate ? deflateReset(&context->stream) : inflateReset(&context->stream);
+	if (rc != Z_OK) {
+		zwszlib_end(context);
+		return;
+	}
+
+	zwszlib_context_t** idle = zwszlib_idle_list(self, context->deflate, context->window_bits, context->mem_level);
+	context->next = *idle;
+	*idle = context;
+	self->stats.idle++;
+}
+
+void zwszlib_get_stats(zwszlib_t* self, zwszlib_stats_t* stats) {
+	*stats = self->stats;
+}
+
+static zwszlib_context_t* zwszlib_context_new(zwszlib_t* self) {
+	zwszlib_context_t* context = (zwszlib_context_t *)zmalloc(sizeof(zwszlib_context_t));
+	context->stream.zalloc = zwszlib_alloc;
+	context->stream.zfree = zwszlib_free;
+	context->stream.opaque = self;
+	return context;
+}
+
+static zwszlib_context_t** zwszlib_idle_list(zwszlib_t* self, bool deflate, int window_bits, int mem_level) {
+	return deflate ? &self->deflaters[window_bits - 9][mem_level - 1] : &self->inflaters[window_bits - 8];
+}
+
+static void zwszlib_end(zwszlib_context_t* context) {
+	if (context->deflate) {
+		deflateEnd(&context->stream);
+	} else {
+		inflateEnd(&context->stream);
+	}
+	free(context);
+}
+
+/**
+ * zlib allocator: a block from a slab of its size class, or from the heap when the size has no
+ * class or a new slab would exceed the ceiling
+*/
+static voidpf zwszlib_alloc(voidpf opaque, uInt items, uInt size) {
+	zwszlib_t* self = (zwszlib_t *)opaque;
+	if (size != 0 && items > (SIZE_MAX - ZWSZLIB_SLAB_SIZE) / size) {
+		return Z_NULL;
+	}
+	size_t length = (size_t)items * size;
+	zwszlib_block_t* block;
+
+	size_t size_class = zwszlib_size_class(self, length);
+	if (size_class < ZWSZLIB_SIZE_CLASSES) {
+		zwszlib_class_t* pool = &self->classes[size_class];
+		zwszlib_slab_t* slab = pool->spare != NULL ? pool->spare : zwszlib_slab_new(self, size_class);
+
+		if (slab != NULL) {
+			block = slab->free;
+			if (block != NULL) {
+				slab->free = block->next;
+			} else {
+				block = (zwszlib_block_t *)((byte *)(slab + 1) + slab->carved * pool->stride);
+				block->slab = slab;
+				slab->carved++;
+			}
+
+			slab->used++;
+			if (slab->used == pool->blocks) {
+				zwszlib_unlink(pool, slab);
+			}
+			self->stats.used += pool->stride;
+			return block + 1;
+		}
+	}
+
+	block = (zwszlib_block_t *)malloc(sizeof(zwszlib_block_t) + length);
+	if (block == NULL) {
+		return Z_NULL;
+	}
+	block->slab = NULL;
+	self->stats.heap_allocations++;
+	return block + 1;
+}
+
+static void zwszlib_free(voidpf opaque, voidpf address) {
+	zwszlib_t* self = (zwszlib_t *)opaque;
+	zwszlib_block_t* block = (zwszlib_block_t *)address - 1;
+	zwszlib_slab_t* slab = block->slab;
+
+	if (slab == NULL) {
+		free(block);
+		return;
+	}
+
+	zwszlib_class_t* pool = &self->classes[slab->size_class];
+	if (slab->used == pool->blocks) {
+		// Full slabs aren't listed, it has a block to spare again
+		slab->prev = NULL;
+		slab->next = pool->spare;
+		if (pool->spare != NULL) {
+			pool->spare->prev = slab;
+		}
+		pool->spare = slab;
+	}
+
+	block->next = slab->free;
+	slab->free = block;
+	slab->used--;
+	self->stats.used -= pool->stride;
+
+	if (slab->used == 0 && self->stats.held > self->ceiling) {
+		zwszlib_unlink(pool, slab);
+		zwszlib_slab_destroy(self, slab);
+	}
+}
+
+/**
+ * Class of the blocks of `size` bytes, taking a free class for a size not seen yet;
+ * ZWSZLIB_SIZE_CLASSES when all are taken
+*/
+static size_t zwszlib_size_class(zwszlib_t* self, size_t size) {
+	size_t size_class = 0;
+	while (size_class < ZWSZLIB_SIZE_CLASSES && self->classes[size_class].size != size && self->classes[size_class].size != 0) {
+		size_class++;
+	}
+
+	if (size_class < ZWSZLIB_SIZE_CLASSES && self->classes[size_class].size == 0 && size != 0) {
+		zwszlib_class_t* pool = &self->classes[size_class];
+		pool->size = size;
+		pool->stride = (sizeof(zwszlib_block_t) + size + ZWSZLIB_ALIGNMENT - 1) & ~(size_t)(ZWSZLIB_ALIGNMENT - 1);
+		pool->blocks = pool->stride < ZWSZLIB_SLAB_SIZE - sizeof(zwszlib_slab_t) ? (ZWSZLIB_SLAB_SIZE - sizeof(zwszlib_slab_t)) / pool->stride : 1;
+	}
+	return size != 0 ? size_class : ZWSZLIB_SIZE_CLASSES;
+}
+
+/**
+ * New spare slab for `size_class`, NULL if it doesn't fit under the ceiling even once empty slabs
+ * are given back
+*/
+static zwszlib_slab_t* zwszlib_slab_new(zwszlib_t* self, size_t size_class) {
+	zwszlib_class_t* pool = &self->classes[size_class];
+	size_t bytes = sizeof(zwszlib_slab_t) + pool->blocks * pool->stride;
+
+	if (self->stats.held + bytes > self->ceiling) {
+		zwszlib_trim(self, bytes);
+		if (self->stats.held + bytes > self->ceiling) {
+			return NULL;
+		}
+	}
+
+	// Blocks are carved as needed, only the header is cleared
+	zwszlib_slab_t* slab = (zwszlib_slab_t *)malloc(bytes);
+	if (slab == NULL) {
+		return NULL;
+	}
+	memset(slab, 0, sizeof(zwszlib_slab_t));
+	slab->size_class = size_class;
+	slab->next = pool->spare;
+	if (pool->spare != NULL) {
+		pool->spare->prev = slab;
+	}
+	pool->spare = slab;
+
+	self->stats.held += bytes;
+	if (self->stats.held > self->stats.peak) {
+		self->stats.peak = self->stats.held;
+	}
+	self->stats.slabs_allocated++;
+	return slab;
+}
+
+static void zwszlib_slab_destroy(zwszlib_t* self, zwszlib_slab_t* slab) {
+	zwszlib_class_t* pool = &self->classes[slab->size_class];
+	self->stats.held -= sizeof(zwszlib_slab_t) + pool->blocks * pool->stride;
+	free(slab);
+}
+
+static void zwszlib_unlink(zwszlib_class_t* pool, zwszlib_slab_t* slab) {
+	if (slab->prev != NULL) {
+		slab->prev->next = slab->next;
+	} else {
+		pool->spare = slab->next;
+	}
+	if (slab->next != NULL) {
+		slab->next->prev = slab->prev;
+	}
+	slab->prev = NULL;
+	slab->next = NULL;
+}
+
+/**
+ * Give empty slabs back to the heap until `needed` more bytes fit under the ceiling
+*/
+static void zwszlib_trim(zwszlib_t* self, size_t needed) {
+	for (size_t size_class = 0; size_class < ZWSZLIB_SIZE_CLASSES; size_class++) {
+		zwszlib_slab_t* slab = self->classes[size_class].spare;
+		while (slab != NULL && self->stats.held + needed > self->ceiling) {
+			zwszlib_slab_t* next = slab->next;
+			if (slab->used == 0) {
+				zwszlib_unlink(&self->classes[size_class], slab);
+				zwszlib_slab_destroy(self, slab);
+			}
+			slab = next;
+		}
+	}
+}
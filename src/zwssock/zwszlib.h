@@ -0,0 +1,52 @@
+#ifndef ZWSZLIB_H_
+#define ZWSZLIB_H_
+
+#include <czmq.h>
+#include <zlib.h>
+
+// Pool of ready raw zlib contexts, owned by one thread. A context is lent for one message to a client
+// that keeps no context between messages, or for the life of a client that does, and reset when returned
+typedef struct _zwszlib_t zwszlib_t;
+
+// Pool occupancy, see zwszlib_get_stats
+typedef struct {
+	size_t active;              // Contexts lent out
+	size_t idle;                // Contexts ready for reuse
+	size_t held;                // Bytes of slabs, in use or not
+	size_t used;                // Bytes of slab blocks in use by contexts
+	size_t peak;                // Most bytes of slabs held at once
+	size_t slabs_allocated;     // Slabs taken from the heap
+	size_t heap_allocations;    // zlib allocations that didn't fit a slab, under the ceiling or at all
+} zwszlib_stats_t;
+
+// Keeps up to `max_idle` returned contexts ready for reuse; the memory of all contexts, lent or idle,
+// is carved from slabs up to `ceiling` bytes, then from the heap
+zwszlib_t* zwszlib_new(size_t max_idle, size_t ceiling);
+
+// Contexts still lent out must be released first
+void zwszlib_destroy(zwszlib_t** self_p);
+
+// Empty slabs are given back to the heap until the slabs held fit under `ceiling`
+void zwszlib_set_ceiling(zwszlib_t* self, size_t ceiling);
+
+// Deflate context with a `window_bits` window (9 to 15) and `mem_level` (1 to 9); NULL on failure
+z_stream* zwszlib_deflater(zwszlib_t* self, int window_bits, int mem_level);
+
+// Inflate context with a `window_bits` window (8 to 15); NULL on failure. The context allocates
+// nothing once lent, so it may be used on another thread
+z_stream* zwszlib_inflater(zwszlib_t* self, int window_bits);
+
+// Return a context, which is reset for its next borrower or ended if enough are idle; NULL is ignored
+void zwszlib_release(zwszlib_t* self, z_stream** stream_p);
+
+void zwszlib_get_stats(zwszlib_t* self, zwszlib_stats_t* stats);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // ZWSZLIB_H_
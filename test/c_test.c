@@ -54,7 +54,9 @@ int main(int argc, char** argv) {
 
 		str_req = get_next_string(msg);
 
-		printf("Received message from client [%s]: ", zframe_strdup(id));
+		char* str_id = zframe_strdup(id);
+		printf("Received message from client [%s]: ", str_id);
+		free(str_id);
 		printf("\"%s\"", str_req);
 		// printf(", %i", *(int16_t*)get_next_data(msg));
 		// printf(", %i", *(int16_t*)get_next_data(msg));
@@ -74,10 +76,9 @@ int main(int argc, char** argv) {
 		zmsg_push(res, id);
 
 		// Add payload
-		char* str_res = (char *)malloc((28 + strlen(str_req)) * sizeof(char));
-		strcat(str_res, "Hello world! You sent me \'");
-		strcat(str_res, str_req);
-		strcat(str_res, "\'.");
+		size_t str_res_size = 29 + strlen(str_req);
+		char* str_res = (char *)malloc(str_res_size * sizeof(char));
+		snprintf(str_res, str_res_size, "Hello world! You sent me \'%s\'.", str_req);
 		zmsg_addstr(res, str_res);
 
 		// int16_t int_pos = 9999;
@@ -0,0 +1,287 @@
+#include <czmq.h>
+#include <zlib.h>
+#include "zwssock/zwsdecoder.h"
+#include "zwssock/zwsencoder.h"
+
+// Micro-benchmarks of the decoder, the frame encoder and permessage-deflate.
+//
+// Prints one JSON object per line:
+//   {"bench": "decode", "size": 1024, "split": "frame", "messages": ..., "bytes": ..., "seconds": ...,
+//    "msgs_per_s": ..., "mb_per_s": ..., "ns_per_msg": ...}
+// deflate and inflate lines also carry the compression "ratio".
+//
+// Usage: zws_bench [-m megabytes per case] [size ...]
+
+static const size_t DEFAULT_SIZES[] = { 16, 125, 1024, 16384, 65536, 1048576 };
+static const size_t MIN_MESSAGES = 100;
+
+typedef enum {
+	SPLIT_WHOLE,    // All frames in a single read
+	SPLIT_FRAME,    // One read per frame
+	SPLIT_1500,     // Reads of an Ethernet MTU, frames straddle reads
+	SPLIT_COUNT
+} split_t;
+
+static const char* SPLIT_NAMES[] = { "whole", "frame", "1500" };
+
+static size_t s_received;
+static size_t s_received_bytes;
+
+
+static void on_message(void* tag, byte* payload, size_t length, zwsdecoder_buffer_t* buffer) {
+	s_received++;
+	s_received_bytes += length;
+}
+
+static void on_control(void* tag, byte* payload, size_t length) {
+}
+
+static void report(const char* bench, size_t size, const char* split, size_t messages, int64_t usecs, double ratio) {
+	double seconds = usecs > 0 ? usecs / 1e6 : 1e-6;
+	double bytes = (double)messages * size;
+
+	printf("{\"bench\": \"%s\", \"size\": %zu, \"split\": \"%s\", \"messages\": %zu, \"bytes\": %.0f, "
+		"\"seconds\": %.6f, \"msgs_per_s\": %.0f, \"mb_per_s\": %.2f, \"ns_per_msg\": %.1f",
+		bench, size, split, messages, bytes, seconds,
+		messages / seconds, bytes / seconds / 1e6, seconds * 1e9 / messages);
+	if (ratio > 0) {
+		printf(", \"ratio\": %.4f", ratio);
+	}
+	printf("}\n");
+	fflush(stdout);
+}
+
+static void fail(const char* bench, size_t size) {
+	fprintf(stderr, "%s of %zu byte messages failed\n", bench, size);
+	exit(1);
+}
+
+/**
+ * Fill a payload with compressible, text-like data
+*/
+static void fill_payload(byte* payload, size_t size) {
+	static const char text[] = "{\"x\": 0.125, \"y\": -3.5, \"z\": 42.0, \"id\": \"sensor-17\"}, ";
+	for (size_t i = 0; i < size; i++) {
+		payload[i] = text[i % (sizeof(text) - 1)];
+	}
+}
+
+/**
+ * Write a masked binary frame, as a browser sends it
+*/
+static size_t put_masked_frame(byte* out, const byte* payload, size_t size, uint32_t seed) {
+	size_t h = 0;
+	out[h++] = 0x82;
+
+	if (size < 126) {
+		out[h++] = 0x80 | (byte)size;
+	} else if (size <= 0xFFFF) {
+		out[h++] = 0x80 | 126;
+		out[h++] = (byte)(size >> 8);
+		out[h++] = (byte)size;
+	} else {
+		out[h++] = 0x80 | 127;
+		for (int i = 7; i >= 0; i--) {
+			out[h++] = (byte)((uint64_t)size >> (8 * i));
+		}
+	}
+
+	byte mask[4] = { (byte)seed, (byte)(seed >> 8), (byte)(seed >> 16), (byte)(seed >> 24) | 1 };
+	memcpy(out + h, mask, 4);
+	h += 4;
+
+	for (size_t i = 0; i < size; i++) {
+		out[h + i] = payload[i] ^ mask[i % 4];
+	}
+	return h + size;
+}
+
+static void bench_decode(size_t size, size_t messages, split_t split, zwsarena_t* arena) {
+	byte* payload = (byte*)malloc(size);
+	fill_payload(payload, size);
+
+	// Frames of one batch, decoded over and over
+	size_t batch = messages < 64 ? messages : 64;
+	byte* stream = (byte*)malloc(batch * (size + 14));
+	size_t stream_length = 0;
+	size_t frame_length = 0;
+	for (size_t i = 0; i < batch; i++) {
+		frame_length = put_masked_frame(stream + stream_length, payload, size, (uint32_t)(i * 2654435761u));
+		stream_length += frame_length;
+	}
+
+	size_t read_size = split == SPLIT_WHOLE ? stream_length : split == SPLIT_FRAME ? frame_length : 1500;
+
+	zwsdecoder_t* decoder = zwsdecoder_new(NULL, on_message, on_control, on_control, on_control);
+	zwsdecoder_set_arena(decoder, arena);
+	s_received = 0;
+	s_received_bytes = 0;
+
+	size_t rounds = (messages + batch - 1) / batch;
+	int64_t start = zclock_usecs();
+	for (size_t round = 0; round < rounds; round++) {
+		for (size_t offset = 0; offset < stream_length; offset += read_size) {
+			size_t length = stream_length - offset < read_size ? stream_length - offset : read_size;
+			zframe_t* data = zframe_new(stream + offset, length);
+			zwsdecoder_process_buffer(decoder, &data);
+		}
+	}
+	int64_t usecs = zclock_usecs() - start;
+
+	if (zwsdecoder_is_errored(decoder) || s_received != rounds * batch) {
+		fail("decode", size);
+	}
+	report("decode", size, SPLIT_NAMES[split], s_received, usecs, 0);
+
+	zwsdecoder_destroy(&decoder);
+	free(stream);
+	free(payload);
+}
+
+static void bench_encode(size_t size, size_t messages) {
+	byte* payload = (byte*)malloc(size);
+	fill_payload(payload, size);
+
+	int64_t start = zclock_usecs();
+	for (size_t i = 0; i < messages; i++) {
+		byte header[10];
+		uint64_t frame_size;
+		int payload_start_index;
+		zwsencoder_compute_frame_header(0x82, size + 1, &frame_size, &payload_start_index, header);
+
+		// As the agent builds a frame: header, JSMQ flag byte, payload
+		zframe_t* frame = zframe_new(NULL, frame_size);
+		byte* data = zframe_data(frame);
+		memcpy(data, header, payload_start_index);
+		data[payload_start_index] = 0;
+		memcpy(data + payload_start_index + 1, payload, size);
+		zframe_destroy(&frame);
+	}
+	int64_t usecs = zclock_usecs() - start;
+
+	report("encode", size, "-", messages, usecs, 0);
+	free(payload);
+}
+
+static void bench_deflate_inflate(size_t size, size_t messages) {
+	byte* payload = (byte*)malloc(size);
+	fill_payload(payload, size);
+
+	z_stream deflate_stream;
+	memset(&deflate_stream, 0, sizeof(deflate_stream));
+	int rc = deflateInit2(&deflate_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+	assert(rc == Z_OK);
+
+	z_stream inflate_stream;
+	memset(&inflate_stream, 0, sizeof(inflate_stream));
+	rc = inflateInit2(&inflate_stream, -15);
+	assert(rc == Z_OK);
+
+	// Keep the compressed messages to inflate them afterwards, as the other end of the connection would
+	size_t batch = messages < 64 ? messages : 64;
+	byte** compressed = (byte**)zmalloc(batch * sizeof(byte*));
+	size_t* compressed_length = (size_t*)zmalloc(batch * sizeof(size_t));
+	size_t compressed_bytes = 0;
+	size_t rounds = (messages + batch - 1) / batch;
+	int64_t deflate_usecs = 0;
+	int64_t inflate_usecs = 0;
+
+	for (size_t round = 0; round < rounds; round++) {
+		int64_t start = zclock_usecs();
+		for (size_t i = 0; i < batch; i++) {
+			compressed[i] = (byte*)malloc(zwsencoder_deflate_bound(&deflate_stream, size + 1));
+			compressed_length[i] = zwsencoder_deflate_message(&deflate_stream, 0, payload, size, compressed[i]);
+		}
+		deflate_usecs += zclock_usecs() - start;
+
+		s_received_bytes = 0;
+		start = zclock_usecs();
+		for (size_t i = 0; i < batch; i++) {
+			size_t inflated_length;
+			byte* inflated = zwsdecoder_inflate(&inflate_stream, compressed[i], compressed_length[i], true, size + 64, &inflated_length);
+			if (inflated == NULL) {
+				fail("inflate", size);
+			}
+			s_received_bytes += inflated_length;
+			free(inflated);
+		}
+		inflate_usecs += zclock_usecs() - start;
+
+		if (s_received_bytes != batch * (size + 1)) {
+			fail("inflate", size);
+		}
+
+		for (size_t i = 0; i < batch; i++) {
+			compressed_bytes += compressed_length[i];
+			free(compressed[i]);
+		}
+	}
+
+	double ratio = (double)compressed_bytes / ((double)rounds * batch * (size + 1));
+	report("deflate", size, "-", rounds * batch, deflate_usecs, ratio);
+	report("inflate", size, "-", rounds * batch, inflate_usecs, ratio);
+
+	deflateEnd(&deflate_stream);
+	inflateEnd(&inflate_stream);
+	free(compressed);
+	free(compressed_length);
+	free(payload);
+}
+
+/**
+ * Parse a positive decimal count, the whole argument must be digits
+*/
+static bool s_parse_count(const char* arg, size_t* value) {
+	char* end;
+	errno = 0;
+	unsigned long long parsed = strtoull(arg, &end, 10);
+	if (arg[0] < '0' || arg[0] > '9' || *end != '\0' || errno == ERANGE || parsed == 0 || parsed > SIZE_MAX) {
+		return false;
+	}
+	*value = (size_t)parsed;
+	return true;
+}
+
+int main(int argc, char** argv) {
+	size_t megabytes = 64;
+	size_t sizes[64];
+	size_t size_count = 0;
+
+	for (int i = 1; i < argc; i++) {
+		bool valid;
+		if (streq(argv[i], "-m") && i + 1 < argc) {
+			valid = s_parse_count(argv[++i], &megabytes) && megabytes <= (SIZE_MAX >> 20);
+		} else {
+			valid = size_count < sizeof(sizes) / sizeof(sizes[0]) && s_parse_count(argv[i], &sizes[size_count++]);
+		}
+		if (!valid) {
+			fprintf(stderr, "Invalid argument \"%s\"\n", argv[i]);
+			fprintf(stderr, "Usage: zws_bench [-m megabytes per case] [size ...]\n");
+			return 1;
+		}
+	}
+
+	if (size_count == 0) {
+		size_count = sizeof(DEFAULT_SIZES) / sizeof(DEFAULT_SIZES[0]);
+		memcpy(sizes, DEFAULT_SIZES, sizeof(DEFAULT_SIZES));
+	}
+
+	zwsarena_t* arena = zwsarena_new(32 * 1024 * 1024);
+
+	for (size_t i = 0; i < size_count; i++) {
+		size_t size = sizes[i];
+		size_t messages = (megabytes << 20) / size;
+		if (messages < MIN_MESSAGES) {
+			messages = MIN_MESSAGES;
+		}
+
+		for (int split = 0; split < SPLIT_COUNT; split++) {
+			bench_decode(size, messages, (split_t)split, arena);
+		}
+		bench_encode(size, messages);
+		bench_deflate_inflate(size, messages);
+	}
+
+	zwsarena_destroy(&arena);
+	return 0;
+}
@@ -0,0 +1,633 @@
+#include <czmq.h>
+#include <zlib.h>
+#include "zwssock/zwsdecoder.h"
+#include "zwssock/zwsencoder.h"
+
+// Load generator for a zwssock router, such as the c_test echo server.
+//
+// Opens many WebSocket connections over a single ZMQ_STREAM socket, sends masked JSMQ messages at a
+// fixed total rate (round robin over the connections), and measures the round trip of every reply.
+// Replies are matched to requests in order, per connection. Progress is printed every second on
+// stderr, and a JSON summary on stdout:
+//   {"connections": ..., "sent": ..., "received": ..., "errors": ..., "seconds": ..., "msgs_per_s": ...,
+//    "mb_per_s": ..., "p50_us": ..., "p99_us": ..., "p999_us": ..., "max_us": ...}
+//
+// Usage: zws_load [-e endpoint] [-c connections] [-r messages/s] [-s size] [-f frames] [-d seconds] [-z]
+//   -z offers permessage-deflate in the handshake
+
+static const char* DEFAULT_ENDPOINT = "tcp://127.0.0.1:15798";
+
+static const int64_t CONNECT_TIMEOUT = 10000000;  // usecs
+static const int64_t DRAIN_TIMEOUT = 2000000;     // usecs
+static const int64_t MAX_LAG = 1000000;           // usecs behind schedule before giving up on catching up
+
+#define HANDSHAKE_MAX 2048
+#define HISTOGRAM_BUCKETS 2048
+
+
+//  *************************    HISTOGRAM    *************************
+
+/**
+ * Log-linear latency histogram, 32 buckets per power of two (about 3% resolution)
+*/
+typedef struct {
+	uint64_t counts[HISTOGRAM_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+} histogram_t;
+
+static void histogram_record(histogram_t* self, uint64_t value) {
+	int shift = 0;
+	while ((value >> shift) > 63) {
+		shift++;
+	}
+
+	self->counts[shift * 32 + (value >> shift)]++;
+	self->total++;
+	if (value > self->max) {
+		self->max = value;
+	}
+}
+
+/**
+ * Value below which `percentile` of the recorded values fall (upper bound of its bucket)
+*/
+static uint64_t histogram_percentile(histogram_t* self, double percentile) {
+	uint64_t target = (uint64_t)(self->total * percentile / 100.0 + 0.5);
+	uint64_t count = 0;
+
+	for (int index = 0; index < HISTOGRAM_BUCKETS; index++) {
+		count += self->counts[index];
+		if (count > 0 && count >= target) {
+			int shift = index < 64 ? 0 : index / 32 - 1;
+			uint64_t upper = ((uint64_t)(index - shift * 32 + 1) << shift) - 1;
+			return upper < self->max ? upper : self->max;
+		}
+	}
+	return self->max;
+}
+
+static void histogram_reset(histogram_t* self) {
+	memset(self, 0, sizeof(histogram_t));
+}
+
+
+//  *************************    CONNECTIONS    *************************
+
+typedef enum {
+	CONNECTION_HANDSHAKE,
+	CONNECTION_OPEN,
+	CONNECTION_CLOSED
+} connection_state_t;
+
+typedef struct _load_t load_t;
+
+typedef struct {
+	load_t* load;
+	zframe_t* address;
+	connection_state_t state;
+
+	char handshake[HANDSHAKE_MAX + 1];  // Response to the upgrade request, until complete
+	size_t handshake_length;
+
+	zwsdecoder_t* decoder;
+	bool compressed;
+	bool deflate_reset;                 // The server asked for client_no_context_takeover
+	z_stream deflate_stream;
+	z_stream inflate_stream;
+	bool flag_pending;                  // Next byte of the reply is the JSMQ "more" flag
+	bool reply_continued;
+
+	int64_t* sent_at;                   // Ring of send times of the requests awaiting a reply
+	size_t sent_head;
+	size_t sent_count;
+	size_t sent_capacity;
+} connection_t;
+
+struct _load_t {
+	zsock_t* stream;
+	zhash_t* connections;               // By hex address
+	connection_t** order;               // In connection order, for round robin sending
+	size_t count;
+	size_t open;
+	size_t next;
+
+	// Options
+	const char* endpoint;
+	size_t connections_wanted;
+	double rate;
+	size_t size;
+	int frames;
+	double duration;
+	bool deflate;
+
+	byte* payload;
+
+	// Results
+	histogram_t latency;
+	histogram_t interval_latency;
+	uint64_t sent;
+	uint64_t received;
+	uint64_t interval_received;
+	uint64_t errors;
+	uint64_t bytes_received;
+};
+
+
+static connection_t* connection_new(load_t* load, zframe_t* address) {
+	connection_t* self = (connection_t*)zmalloc(sizeof(connection_t));
+	self->load = load;
+	self->address = zframe_dup(address);
+	self->state = CONNECTION_HANDSHAKE;
+	self->sent_capacity = 64;
+	self->sent_at = (int64_t*)zmalloc(self->sent_capacity * sizeof(int64_t));
+	return self;
+}
+
+static void connection_destroy(connection_t** self_p) {
+	connection_t* self = *self_p;
+	if (self) {
+		if (self->decoder) {
+			zwsdecoder_destroy(&self->decoder);
+		}
+		if (self->compressed) {
+			deflateEnd(&self->deflate_stream);
+			inflateEnd(&self->inflate_stream);
+		}
+		zframe_destroy(&self->address);
+		free(self->sent_at);
+		free(self);
+		*self_p = NULL;
+	}
+}
+
+static void connection_close(connection_t* self) {
+	if (self->state == CONNECTION_OPEN) {
+		self->load->open--;
+	}
+	self->state = CONNECTION_CLOSED;
+
+	// Requests without a reply are lost
+	self->load->errors += self->sent_count;
+	self->sent_count = 0;
+}
+
+static void connection_send_raw(connection_t* self, zframe_t** data_p) {
+	zframe_t* address = zframe_dup(self->address);
+	zframe_send(&address, self->load->stream, ZFRAME_MORE);
+	zframe_send(data_p, self->load->stream, 0);
+}
+
+static void connection_send_upgrade(connection_t* self) {
+	byte key[16];
+	for (int i = 0; i < 16; i++) {
+		key[i] = (byte)rand();
+	}
+
+	zarmour_t* armour = zarmour_new();
+	char* key_base64 = zarmour_encode(armour, key, sizeof(key));
+	zarmour_destroy(&armour);
+
+	char request[512];
+	int length = snprintf(request, sizeof(request),
+		"GET / HTTP/1.1\r\n"
+		"Host: %s\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Key: %s\r\n"
+		"Sec-WebSocket-Version: 13\r\n"
+		"Sec-WebSocket-Protocol: WSNetMQ\r\n"
+		"%s"
+		"\r\n",
+		self->load->endpoint, key_base64,
+		self->load->deflate ? "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n" : "");
+	free(key_base64);
+
+	zframe_t* data = zframe_new(request, length);
+	connection_send_raw(self, &data);
+}
+
+/**
+ * Send one JSMQ message, each of its frames a masked WebSocket message
+*/
+static void connection_send_message(connection_t* self, const byte* payload, size_t size, int frames) {
+	// Remember when the request left, replies come back in order
+	if (self->sent_count == self->sent_capacity) {
+		int64_t* sent_at = (int64_t*)zmalloc(self->sent_capacity * 2 * sizeof(int64_t));
+		for (size_t i = 0; i < self->sent_count; i++) {
+			sent_at[i] = self->sent_at[(self->sent_head + i) % self->sent_capacity];
+		}
+		free(self->sent_at);
+		self->sent_at = sent_at;
+		self->sent_head = 0;
+		self->sent_capacity *= 2;
+	}
+	self->sent_at[(self->sent_head + self->sent_count) % self->sent_capacity] = zclock_usecs();
+	self->sent_count++;
+
+	// One deflate buffer for all the frames of the message
+	byte* compressed = NULL;
+	if (self->compressed) {
+		compressed = (byte*)malloc(zwsencoder_deflate_bound(&self->deflate_stream, size + 1));
+	}
+
+	for (int frame = 0; frame < frames; frame++) {
+		byte flag = frame + 1 < frames ? 1 : 0;
+		size_t length = size + 1;
+		byte header = 0x82;
+
+		if (self->compressed) {
+			if (self->deflate_reset) {
+				deflateReset(&self->deflate_stream);
+			}
+			length = zwsencoder_deflate_message(&self->deflate_stream, flag, payload, size, compressed);
+			header |= 0x40;  // RSV1, compressed
+		}
+
+		byte header_data[10];
+		uint64_t frame_size;
+		int payload_start_index;
+		zwsencoder_compute_frame_header(header, length, &frame_size, &payload_start_index, header_data);
+		header_data[1] |= 0x80;  // Clients mask their frames
+
+		zframe_t* data = zframe_new(NULL, frame_size + 4);
+		byte* outgoing_data = zframe_data(data);
+		memcpy(outgoing_data, header_data, payload_start_index);
+
+		byte mask[4] = { (byte)rand(), (byte)rand(), (byte)rand(), (byte)rand() };
+		memcpy(outgoing_data + payload_start_index, mask, 4);
+
+		byte* masked = outgoing_data + payload_start_index + 4;
+		if (compressed != NULL) {
+			memcpy(masked, compressed, length);
+		} else {
+			masked[0] = flag;
+			memcpy(masked + 1, payload, size);
+		}
+		for (size_t i = 0; i < length; i++) {
+			masked[i] ^= mask[i & 3];
+		}
+
+		connection_send_raw(self, &data);
+	}
+	free(compressed);
+}
+
+static void connection_reply_data(connection_t* self, byte* data, size_t length) {
+	if (self->flag_pending && length > 0) {
+		self->flag_pending = false;
+		self->reply_continued = data[0] == 1;
+	}
+	self->load->bytes_received += length;
+}
+
+static void connection_message_received(void* tag, byte* payload, size_t length, zwsdecoder_buffer_t* buffer) {
+	connection_t* self = (connection_t*)tag;
+	load_t* load = self->load;
+
+	if (self->state != CONNECTION_OPEN) {
+		return;
+	}
+
+	self->flag_pending = true;
+	self->reply_continued = false;
+
+	if (self->compressed && zwsdecoder_is_compressed(self->decoder)) {
+		size_t inflated_length;
+		byte* inflated = zwsdecoder_inflate(&self->inflate_stream, payload, length, true, length * 4 + 64, &inflated_length);
+		if (inflated == NULL) {
+			load->errors++;
+			connection_close(self);
+			return;
+		}
+		connection_reply_data(self, inflated, inflated_length);
+		free(inflated);
+	} else {
+		connection_reply_data(self, payload, length);
+	}
+
+	if (self->reply_continued) {
+		return;
+	}
+
+	// Reply complete
+	if (self->sent_count == 0) {
+		load->errors++;
+		return;
+	}
+
+	uint64_t latency = zclock_usecs() - self->sent_at[self->sent_head];
+	self->sent_head = (self->sent_head + 1) % self->sent_capacity;
+	self->sent_count--;
+
+	histogram_record(&load->latency, latency);
+	histogram_record(&load->interval_latency, latency);
+	load->received++;
+	load->interval_received++;
+}
+
+static void connection_close_received(void* tag, byte* payload, size_t length) {
+	connection_close((connection_t*)tag);
+}
+
+static void connection_control_received(void* tag, byte* payload, size_t length) {
+}
+
+/**
+ * Collect the upgrade response, then switch to WebSocket framing
+*/
+static void connection_handshake_read(connection_t* self, zframe_t** data_p) {
+	zframe_t* data = *data_p;
+	size_t size = zframe_size(data);
+
+	if (self->handshake_length + size > HANDSHAKE_MAX) {
+		size = HANDSHAKE_MAX - self->handshake_length;
+	}
+	memcpy(self->handshake + self->handshake_length, zframe_data(data), size);
+	self->handshake_length += size;
+	self->handshake[self->handshake_length] = '\0';
+
+	char* end = strstr(self->handshake, "\r\n\r\n");
+	if (end == NULL) {
+		if (self->handshake_length == HANDSHAKE_MAX) {
+			self->load->errors++;
+			connection_close(self);
+		}
+		zframe_destroy(data_p);
+		return;
+	}
+
+	if (strncmp(self->handshake, "HTTP/1.1 101", 12) != 0) {
+		fprintf(stderr, "Upgrade refused: %.*s\n", (int)(strchr(self->handshake, '\r') - self->handshake), self->handshake);
+		self->load->errors++;
+		connection_close(self);
+		zframe_destroy(data_p);
+		return;
+	}
+
+	// Compress if the server accepted the extension, within the window it allows
+	*end = '\0';
+	if (strstr(self->handshake, "permessage-deflate") != NULL) {
+		char* window_bits = strstr(self->handshake, "client_max_window_bits=");
+		int bits = window_bits != NULL ? atoi(window_bits + strlen("client_max_window_bits=")) : 15;
+		self->deflate_reset = strstr(self->handshake, "client_no_context_takeover") != NULL;
+
+		int rc = deflateInit2(&self->deflate_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -(bits < 9 ? 9 : bits), 8, Z_DEFAULT_STRATEGY);
+		assert(rc == Z_OK);
+		rc = inflateInit2(&self->inflate_stream, -15);
+		assert(rc == Z_OK);
+		self->compressed = true;
+	}
+
+	self->decoder = zwsdecoder_new(self, connection_message_received, connection_close_received,
+		connection_control_received, connection_control_received);
+	zwsdecoder_set_permessage_deflate(self->decoder, self->compressed);
+	self->state = CONNECTION_OPEN;
+	self->load->open++;
+
+	// Frames may follow the response in the same read
+	size_t consumed = (end + 4 - self->handshake) - (self->handshake_length - size);
+	if (consumed < zframe_size(data)) {
+		zframe_t* rest = zframe_new(zframe_data(data) + consumed, zframe_size(data) - consumed);
+		zwsdecoder_process_buffer(self->decoder, &rest);
+	}
+	zframe_destroy(data_p);
+}
+
+
+//  *************************    LOAD    *************************
+
+static void load_receive(load_t* self) {
+	zframe_t* address = zframe_recv(self->stream);
+	zframe_t* data = zframe_recv(self->stream);
+	if (!address || !data) {
+		zframe_destroy(&address);
+		zframe_destroy(&data);
+		return;
+	}
+
+	char* key = zframe_strhex(address);
+	connection_t* connection = (connection_t*)zhash_lookup(self->connections, key);
+
+	// Connection established
+	if (connection == NULL) {
+		if (zframe_size(data) == 0 && self->count < self->connections_wanted) {
+			connection = connection_new(self, address);
+			zhash_insert(self->connections, key, connection);
+			self->order[self->count++] = connection;
+			connection_send_upgrade(connection);
+		}
+		zframe_destroy(&data);
+
+	// Disconnected
+	} else if (zframe_size(data) == 0) {
+		if (connection->state != CONNECTION_CLOSED) {
+			connection_close(connection);
+		}
+		zframe_destroy(&data);
+
+	} else if (connection->state == CONNECTION_HANDSHAKE) {
+		connection_handshake_read(connection, &data);
+
+	} else if (connection->state == CONNECTION_OPEN) {
+		zwsdecoder_process_buffer(connection->decoder, &data);
+		if (zwsdecoder_is_errored(connection->decoder)) {
+			self->errors++;
+			connection_close(connection);
+		}
+
+	} else {
+		zframe_destroy(&data);
+	}
+
+	free(key);
+	zframe_destroy(&address);
+}
+
+/**
+ * Send the next message, to the next open connection in turn
+*/
+static void load_send(load_t* self) {
+	for (size_t tried = 0; tried < self->count; tried++) {
+		connection_t* connection = self->order[self->next];
+		self->next = (self->next + 1) % self->count;
+
+		if (connection->state == CONNECTION_OPEN) {
+			connection_send_message(connection, self->payload, self->size, self->frames);
+			self->sent++;
+			return;
+		}
+	}
+}
+
+static size_t load_outstanding(load_t* self) {
+	size_t outstanding = 0;
+	for (size_t i = 0; i < self->count; i++) {
+		outstanding += self->order[i]->sent_count;
+	}
+	return outstanding;
+}
+
+/**
+ * Wait up to `timeout` usecs for traffic, and process all of it
+*/
+static void load_poll(load_t* self, zpoller_t* poller, int64_t timeout) {
+	int timeout_ms = (int)(timeout / 1000);
+	if (timeout_ms < 1) {
+		timeout_ms = 1;
+	}
+
+	if (zpoller_wait(poller, timeout_ms) == self->stream) {
+		while (zsock_events(self->stream) & ZMQ_POLLIN) {
+			load_receive(self);
+		}
+	}
+}
+
+static void load_report(load_t* self, double seconds) {
+	double bytes = (double)self->received * self->size * self->frames;
+
+	printf("{\"connections\": %zu, \"sent\": %llu, \"received\": %llu, \"errors\": %llu, \"seconds\": %.3f, "
+		"\"msgs_per_s\": %.0f, \"mb_per_s\": %.2f, \"p50_us\": %llu, \"p99_us\": %llu, \"p999_us\": %llu, \"max_us\": %llu}\n",
+		self->count,
+		(unsigned long long)self->sent,
+		(unsigned long long)self->received,
+		(unsigned long long)(self->errors + load_outstanding(self)),
+		seconds,
+		self->received / seconds,
+		bytes / seconds / 1e6,
+		(unsigned long long)histogram_percentile(&self->latency, 50),
+		(unsigned long long)histogram_percentile(&self->latency, 99),
+		(unsigned long long)histogram_percentile(&self->latency, 99.9),
+		(unsigned long long)self->latency.max);
+	fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+	load_t* self = (load_t*)zmalloc(sizeof(load_t));
+	self->endpoint = DEFAULT_ENDPOINT;
+	self->connections_wanted = 100;
+	self->rate = 1000;
+	self->size = 64;
+	self->frames = 1;
+	self->duration = 10;
+
+	for (int i = 1; i < argc; i++) {
+		const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+
+		if (streq(argv[i], "-z")) {
+			self->deflate = true;
+		} else if (value == NULL) {
+			fprintf(stderr, "Usage: zws_load [-e endpoint] [-c connections] [-r messages/s] [-s size] [-f frames] [-d seconds] [-z]\n");
+			return 1;
+		} else if (streq(argv[i], "-e")) {
+			self->endpoint = value;
+			i++;
+		} else if (streq(argv[i], "-c")) {
+			self->connections_wanted = strtoul(value, NULL, 10);
+			i++;
+		} else if (streq(argv[i], "-r")) {
+			self->rate = atof(value);
+			i++;
+		} else if (streq(argv[i], "-s")) {
+			self->size = strtoul(value, NULL, 10);
+			i++;
+		} else if (streq(argv[i], "-f")) {
+			self->frames = atoi(value);
+			i++;
+		} else if (streq(argv[i], "-d")) {
+			self->duration = atof(value);
+			i++;
+		}
+	}
+
+	if (self->connections_wanted == 0 || self->rate <= 0 || self->frames < 1) {
+		fprintf(stderr, "Connections, rate and frames must be positive\n");
+		return 1;
+	}
+
+	// Printable payload, the echo server handles it as a string
+	self->payload = (byte*)malloc(self->size + 1);
+	for (size_t i = 0; i < self->size; i++) {
+		self->payload[i] = (byte)('a' + i % 26);
+	}
+
+	srand((unsigned int)zclock_usecs());
+	self->connections = zhash_new();
+	self->order = (connection_t**)zmalloc(self->connections_wanted * sizeof(connection_t*));
+	self->stream = zsock_new(ZMQ_STREAM);
+	zsock_set_sndhwm(self->stream, 0);
+	zsock_set_rcvhwm(self->stream, 0);
+	zpoller_t* poller = zpoller_new(self->stream, NULL);
+
+	// Connect, each connect opens one more connection of the stream socket
+	for (size_t i = 0; i < self->connections_wanted; i++) {
+		if (zsock_connect(self->stream, "%s", self->endpoint) == -1) {
+			fprintf(stderr, "Could not connect to \"%s\"\n", self->endpoint);
+			return 1;
+		}
+	}
+
+	int64_t deadline = zclock_usecs() + CONNECT_TIMEOUT;
+	while (!zsys_interrupted && self->open < self->connections_wanted && zclock_usecs() < deadline) {
+		load_poll(self, poller, 100000);
+	}
+	fprintf(stderr, "%zu of %zu connections open\n", self->open, self->connections_wanted);
+
+	// Send at a fixed rate, catching up in bursts between polls
+	double interval = 1e6 / self->rate;
+	int64_t start = zclock_usecs();
+	int64_t end = start + (int64_t)(self->duration * 1e6);
+	int64_t next_report = start + 1000000;
+	double next_send = (double)start;
+
+	while (!zsys_interrupted && self->open > 0) {
+		int64_t now = zclock_usecs();
+		if (now >= end) {
+			break;
+		}
+
+		if (now - next_send > MAX_LAG) {
+			next_send = (double)now;
+		}
+		while (next_send <= now) {
+			load_send(self);
+			next_send += interval;
+		}
+
+		if (now >= next_report) {
+			fprintf(stderr, "%3.0fs: received %llu/s, p50 %llu us, p99 %llu us, p999 %llu us, errors %llu\n",
+				(now - start) / 1e6,
+				(unsigned long long)self->interval_received,
+				(unsigned long long)histogram_percentile(&self->interval_latency, 50),
+				(unsigned long long)histogram_percentile(&self->interval_latency, 99),
+				(unsigned long long)histogram_percentile(&self->interval_latency, 99.9),
+				(unsigned long long)self->errors);
+			histogram_reset(&self->interval_latency);
+			self->interval_received = 0;
+			next_report += 1000000;
+		}
+
+		load_poll(self, poller, (int64_t)next_send - now);
+	}
+	double seconds = (zclock_usecs() - start) / 1e6;
+
+	// Collect the replies still in flight
+	deadline = zclock_usecs() + DRAIN_TIMEOUT;
+	while (!zsys_interrupted && self->open > 0 && load_outstanding(self) > 0 && zclock_usecs() < deadline) {
+		load_poll(self, poller, 100000);
+	}
+
+	load_report(self, seconds);
+
+	zpoller_destroy(&poller);
+	zsock_destroy(&self->stream);
+	for (size_t i = 0; i < self->count; i++) {
+		connection_destroy(&self->order[i]);
+	}
+	zhash_destroy(&self->connections);
+	free(self->order);
+	free(self->payload);
+	free(self);
+	return 0;
+}
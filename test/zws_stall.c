@@ -0,0 +1,206 @@
+#include <czmq.h>
+#include "zwssock/zwssock.h"
+
+// Regression run for an application that falls behind its clients.
+//
+// Clients flood a zwssock router while the application doesn't read, so the agent's data socket
+// fills up. The application then sets an option and catches up slowly, broadcasting every message
+// it reads to all the clients and reading the agent's counters every STATS_INTERVAL messages. The
+// agent must keep answering the application's requests whatever is left unread on the data socket;
+// if the run doesn't finish in time it is reported as stalled and exits with 1.
+// A JSON summary goes to stdout:
+//   {"connections": ..., "messages": ..., "broadcasts": ..., "stats": ..., "seconds": ...}
+//
+// Usage: zws_stall [-e endpoint] [-c connections] [-n messages per connection] [-w workers] [-t timeout seconds]
+
+static const char* DEFAULT_ENDPOINT = "tcp://127.0.0.1:15799";
+
+static const int STALL_DELAY = 500;         // msecs the application reads nothing after the flood
+static const int64_t CONNECT_TIMEOUT = 5000; // msecs
+static const size_t STATS_INTERVAL = 100;   // messages read between zwssock_get_stats calls
+
+#define MAX_CONNECTIONS 64
+
+
+/**
+ * Exit with an error unless told to stop within `args` msecs
+*/
+static void s_watchdog(zsock_t* pipe, void* args) {
+	zsock_signal(pipe, 0);
+	zpoller_t* poller = zpoller_new(pipe, NULL);
+	if (zpoller_wait(poller, (int)(intptr_t)args) == NULL && !zpoller_terminated(poller)) {
+		fprintf(stderr, "Stalled: the application's requests were not answered in time\n");
+		exit(1);
+	}
+	zpoller_destroy(&poller);
+}
+
+/**
+ * Send one masked JSMQ message (flag byte 0) on a client connection
+*/
+static void s_client_send(zsock_t* stream, zframe_t* address, const char* text) {
+	size_t length = strlen(text) + 1;
+	assert(length < 126);
+
+	byte frame[2 + 4 + 126];
+	byte mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+	frame[0] = 0x82;
+	frame[1] = (byte)(0x80 | length);
+	memcpy(frame + 2, mask, 4);
+	frame[6] = 0 ^ mask[0];
+	for (size_t i = 1; i < length; i++) {
+		frame[6 + i] = (byte)text[i - 1] ^ mask[i % 4];
+	}
+
+	zframe_send(&address, stream, ZFRAME_MORE + ZFRAME_REUSE);
+	zmq_send(zsock_resolve(stream), frame, 6 + length, 0);
+}
+
+/**
+ * Read and drop whatever the clients were sent, without blocking
+*/
+static void s_client_drain(zsock_t* stream) {
+	while (zsock_events(stream) & ZMQ_POLLIN) {
+		zmsg_t* msg = zmsg_recv(stream);
+		zmsg_destroy(&msg);
+	}
+}
+
+int main(int argc, char** argv) {
+	const char* endpoint = DEFAULT_ENDPOINT;
+	size_t connections = 4;
+	size_t messages = 2500;
+	size_t workers = 0;
+	int timeout = 30;
+
+	for (int i = 1; i < argc; i++) {
+		const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+		if (value == NULL) {
+			fprintf(stderr, "Usage: zws_stall [-e endpoint] [-c connections] [-n messages per connection] [-w workers] [-t timeout seconds]\n");
+			return 1;
+		} else if (streq(argv[i], "-e")) {
+			endpoint = value;
+			i++;
+		} else if (streq(argv[i], "-c")) {
+			connections = strtoul(value, NULL, 10);
+			i++;
+		} else if (streq(argv[i], "-n")) {
+			messages = strtoul(value, NULL, 10);
+			i++;
+		} else if (streq(argv[i], "-w")) {
+			workers = strtoul(value, NULL, 10);
+			i++;
+		} else if (streq(argv[i], "-t")) {
+			timeout = atoi(value);
+			i++;
+		}
+	}
+
+	if (connections == 0 || connections > MAX_CONNECTIONS || messages == 0 || timeout <= 0) {
+		fprintf(stderr, "Connections (up to %d), messages and timeout must be positive\n", MAX_CONNECTIONS);
+		return 1;
+	}
+
+	zwssock_t* sock = zwssock_new_router();
+	zwssock_set_workers(sock, workers);
+	if (zwssock_bind(sock, endpoint) == -1) {
+		fprintf(stderr, "Could not bind router to \"%s\"\n", endpoint);
+		zwssock_destroy(&sock);
+		return 1;
+	}
+
+	// Clients: one stream socket, each connect opens one more connection
+	zsock_t* stream = zsock_new(ZMQ_STREAM);
+	zsock_set_sndhwm(stream, 0);
+	zsock_set_rcvhwm(stream, 0);
+	for (size_t i = 0; i < connections; i++) {
+		zsock_connect(stream, "%s", endpoint);
+	}
+
+	// Each connection is announced by its routing ID and an empty frame, then upgraded
+	zframe_t* addresses[MAX_CONNECTIONS];
+	size_t open = 0;
+	size_t upgraded = 0;
+	int64_t deadline = zclock_mono() + CONNECT_TIMEOUT;
+	zsock_set_rcvtimeo(stream, 100);
+	while (upgraded < connections && zclock_mono() < deadline) {
+		zframe_t* address = zframe_recv(stream);
+		if (address == NULL) {
+			continue;
+		}
+		zframe_t* data = zframe_recv(stream);
+		if (data != NULL && zframe_size(data) == 0 && open < connections) {
+			addresses[open++] = zframe_dup(address);
+			zframe_send(&address, stream, ZFRAME_MORE);
+			zstr_send(stream,
+				"GET / HTTP/1.1\r\n"
+				"Host: localhost\r\n"
+				"Upgrade: websocket\r\n"
+				"Connection: Upgrade\r\n"
+				"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+				"Sec-WebSocket-Version: 13\r\n"
+				"Sec-WebSocket-Protocol: WSNetMQ\r\n\r\n");
+		} else if (data != NULL && zframe_size(data) >= 12 && memcmp(zframe_data(data), "HTTP/1.1 101", 12) == 0) {
+			upgraded++;
+		}
+		zframe_destroy(&address);
+		zframe_destroy(&data);
+	}
+	zsock_set_rcvtimeo(stream, -1);
+	if (upgraded < connections) {
+		fprintf(stderr, "%zu of %zu connections upgraded\n", upgraded, connections);
+		return 1;
+	}
+
+	// The flood, while the application reads nothing
+	zactor_t* watchdog = zactor_new(s_watchdog, (void *)(intptr_t)(timeout * 1000));
+	int64_t start = zclock_mono();
+	for (size_t n = 0; n < messages; n++) {
+		for (size_t i = 0; i < connections; i++) {
+			char text[64];
+			snprintf(text, sizeof(text), "message %zu", n);
+			s_client_send(stream, addresses[i], text);
+		}
+	}
+	zclock_sleep(STALL_DELAY);
+
+	// Options are set while the data socket is full too
+	zwssock_set_batch_size(sock, 16);
+
+	// Catch up, broadcasting each message to every client and reading the counters now and then
+	size_t received = 0;
+	size_t broadcasts = 0;
+	size_t stats_read = 0;
+	while (!zsys_interrupted && received < connections * messages) {
+		zmsg_t* msg = zwssock_recv(sock);
+		if (msg == NULL) {
+			break;
+		}
+		received++;
+
+		if (received % STATS_INTERVAL == 1) {
+			zwssock_stats_t stats;
+			zwssock_get_stats(sock, &stats);
+			stats_read++;
+		}
+
+		zframe_t* client = zmsg_pop(msg);
+		zframe_destroy(&client);
+		if (zwssock_broadcast(sock, NULL, &msg, NULL) > 0) {
+			broadcasts++;
+		}
+		zmsg_destroy(&msg);
+		s_client_drain(stream);
+	}
+	zactor_destroy(&watchdog);
+
+	printf("{\"connections\": %zu, \"messages\": %zu, \"broadcasts\": %zu, \"stats\": %zu, \"seconds\": %.3f}\n",
+		connections, received, broadcasts, stats_read, (zclock_mono() - start) / 1000.0);
+
+	for (size_t i = 0; i < open; i++) {
+		zframe_destroy(&addresses[i]);
+	}
+	zsock_destroy(&stream);
+	zwssock_destroy(&sock);
+	return received == connections * messages ? 0 : 1;
+}